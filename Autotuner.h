@@ -0,0 +1,251 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+
+#include "Equalizer.h"
+#include "ProgramCache.h"
+
+// How a run picks its KernelTuning: from the device profile (measured on first use), measured
+// again and saved, or the built-in defaults. Tuning is opt-in, so runs default to Off.
+enum class TuneMode { Auto, Force, Off };
+
+// Finds the fastest launch shapes of the histogram, scan and apply kernels on one device and
+// keeps them in a per-device profile file (one per device name, driver version and kernel
+// source, under profile_dir), so only the first run on a device pays for the sweep and editing
+// a kernel starts a fresh profile instead of reusing shapes measured for the old code. Every
+// bit depth and bin count is tuned separately, on a synthetic image with a skewed
+// (natural-looking) histogram.
+// The kernels are independent stages, so each one is swept on its own: the histogram over
+// local size, pixels per work-item and local histogram replicas, the scan over its block size
+// and the apply over local size and pixels per work-item. Stages are timed with device events,
+// taking the median of a few runs after a warm-up.
+class Autotuner {
+public:
+    Autotuner(const cl::Context& context, const cl::Device& device, bool use_program_cache, const string& profile_dir = ".cltune")
+        : context(context), device(device), use_program_cache(use_program_cache), profile_dir(profile_dir) {}
+
+    // With TuneMode::Off this touches neither the device nor the file system
+    KernelTuning tuning(int bit_depth, int num_bins, TuneMode mode) {
+        if (mode == TuneMode::Off) {
+            return KernelTuning();
+        }
+        if (profile_path.empty()) {
+            uint64_t hash = hashString(device.getInfo<CL_DEVICE_NAME>());
+            hash = hashString("\n" + device.getInfo<CL_DRIVER_VERSION>(), hash);
+            hash = hashString("\n" + loadKernelSource("kernels/8_bit.cl"), hash);
+            hash = hashString("\n" + loadKernelSource("kernels/16_bit.cl"), hash);
+            stringstream path;
+            path << profile_dir << "/" << hex << setw(16) << setfill('0') << hash << ".tune";
+            profile_path = path.str();
+        }
+        map<pair<int, int>, KernelTuning> profile;
+        load(profile);
+        auto key = make_pair(bit_depth, num_bins);
+        if (mode == TuneMode::Auto && profile.count(key)) {
+            // The program is built with the replica count before any Equalizer sees it
+            KernelTuning stored = profile[key];
+            stored.hist_replicas = Equalizer::fittingReplicas(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>(), stored.hist_replicas);
+            return stored;
+        }
+        if (queue() == nullptr) {
+            queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+        }
+        cout << "Tuning kernels for " << device.getInfo<CL_DEVICE_NAME>() << " (" << bit_depth << "-bit, " << num_bins << " bins)..." << endl;
+        KernelTuning tuned = measure(bit_depth, num_bins);
+        profile[key] = tuned;
+        if (save(profile)) {
+            cout << "Saved tuning to " << profilePath() << endl;
+        }
+        cout << "  histogram: work-group " << tuned.hist_local_size << ", " << tuned.hist_pixels_per_item << " pixels per work-item, "
+             << tuned.hist_replicas << " replica(s); scan: work-group " << tuned.scan_local_size << "; apply: work-group "
+             << tuned.apply_local_size << ", " << tuned.apply_pixels_per_item << " pixels per work-item" << endl;
+        return tuned;
+    }
+
+    const string& profilePath() const { return profile_path; }
+
+private:
+    KernelTuning measure(int bit_depth, int num_bins) {
+        int max_value = (bit_depth == 8) ? 255 : 65535;
+        size_t limit = min(static_cast<size_t>(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()), static_cast<size_t>(256));
+        vector<size_t> local_sizes;
+        for (size_t size = 16; size <= limit; size *= 2) local_sizes.push_back(size);
+        if (local_sizes.empty()) local_sizes.push_back(limit);
+
+        // 2048x2048 single-channel image, skewed towards dark values
+        int total_pixels = 2048 * 2048;
+        vector<unsigned char> image(static_cast<size_t>(total_pixels) * (bit_depth == 8 ? 1 : 2));
+        mt19937 rng(total_pixels);
+        uniform_real_distribution<float> u(0.0f, 1.0f);
+        for (int i = 0; i < total_pixels; i++) {
+            float x = u(rng);
+            unsigned value = static_cast<unsigned>(x * x * max_value);
+            if (bit_depth == 8) {
+                image[i] = static_cast<unsigned char>(value);
+            } else {
+                reinterpret_cast<unsigned short*>(image.data())[i] = static_cast<unsigned short>(value);
+            }
+        }
+
+        KernelTuning best;
+        best.hist_local_size = best.scan_local_size = best.apply_local_size = limit;
+
+        // Histogram. Replicas multiply the local histogram, which must fit local memory; they
+        // only reach the separate histogram kernels that are timed here, as the fused kernels
+        // always keep one copy. Bin counts past 256 use the private sub-histogram kernel, which
+        // has no local histogram to tune.
+        if (num_bins <= 256) {
+            size_t local_memory = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+            double best_ns = 0;
+            for (int replicas : {1, 2, 4, 8}) {
+                if (256 * replicas * sizeof(int) > local_memory) break;
+                cl::Program program;
+                if (!buildEqualizerProgram(context, device, bit_depth, num_bins, use_program_cache, program, false, replicas)) break;
+                Equalizer equalizer(context, device, queue, program, bit_depth);
+                equalizer.enableProfiling();
+                bool uploaded = false;
+                for (size_t local_size : local_sizes) {
+                    for (int pixels : {0, 256, 1024, 4096, 16384}) {
+                        KernelTuning candidate = best;
+                        candidate.hist_local_size = local_size;
+                        candidate.hist_pixels_per_item = pixels;
+                        equalizer.setTuning(candidate);
+                        equalizer.prepare(total_pixels, num_bins);
+                        if (!uploaded) {
+                            equalizer.upload(image.data());
+                            uploaded = true;
+                        }
+                        double ns = timeStage(equalizer, [&] { equalizer.histogram(); });
+                        if (best_ns == 0 || ns < best_ns) {
+                            best_ns = ns;
+                            best.hist_local_size = local_size;
+                            best.hist_pixels_per_item = pixels;
+                            best.hist_replicas = replicas;
+                        }
+                    }
+                }
+            }
+        }
+
+        cl::Program program;
+        if (!buildEqualizerProgram(context, device, bit_depth, num_bins, use_program_cache, program)) {
+            return KernelTuning();
+        }
+        Equalizer equalizer(context, device, queue, program, bit_depth);
+        equalizer.enableProfiling();
+        equalizer.setTuning(best);
+        equalizer.prepare(total_pixels, num_bins);
+        equalizer.upload(image.data());
+        equalizer.histogram();
+
+        // Scan: Blelloch blocks must be powers of two, as all local_sizes are
+        double best_ns = 0;
+        for (size_t local_size : local_sizes) {
+            KernelTuning candidate = best;
+            candidate.scan_local_size = local_size;
+            equalizer.setTuning(candidate);
+            equalizer.prepare(total_pixels, num_bins);
+            double ns = timeStage(equalizer, [&] { equalizer.blellochScan(); });
+            if (best_ns == 0 || ns < best_ns) {
+                best_ns = ns;
+                best.scan_local_size = local_size;
+            }
+        }
+        equalizer.normalize();
+
+        // Apply: the 8-bit kernel maps 16-pixel vectors, so its candidates are multiples of 16
+        best_ns = 0;
+        vector<int> apply_pixels = (bit_depth == 8) ? vector<int>{0, 64, 256, 1024} : vector<int>{0, 4, 16, 64, 256};
+        for (size_t local_size : local_sizes) {
+            for (int pixels : apply_pixels) {
+                KernelTuning candidate = best;
+                candidate.apply_local_size = local_size;
+                candidate.apply_pixels_per_item = pixels;
+                equalizer.setTuning(candidate);
+                equalizer.prepare(total_pixels, num_bins);
+                double ns = timeStage(equalizer, [&] { equalizer.apply(); });
+                if (best_ns == 0 || ns < best_ns) {
+                    best_ns = ns;
+                    best.apply_local_size = local_size;
+                    best.apply_pixels_per_item = pixels;
+                }
+            }
+        }
+        return best;
+    }
+
+    // Median device time of the kernels stage enqueues, over a few runs after a warm-up
+    double timeStage(Equalizer& equalizer, const function<void()>& stage) {
+        const int warmup = 1, repetitions = 5;
+        vector<double> samples;
+        for (int r = 0; r < warmup + repetitions; r++) {
+            equalizer.profile.clear();
+            stage();
+            queue.finish();
+            double ns = 0;
+            for (const auto& command : equalizer.profile) {
+                if (command.transfer) continue;
+                ns += static_cast<double>(command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                                          command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+            }
+            if (r >= warmup) samples.push_back(ns);
+        }
+        sort(samples.begin(), samples.end());
+        return samples[samples.size() / 2];
+    }
+
+    // Profile files are text: '#' comment lines, then one line per bit depth and bin count:
+    // bit_depth bins hist_local_size hist_pixels_per_item hist_replicas scan_local_size
+    // apply_local_size apply_pixels_per_item
+    void load(map<pair<int, int>, KernelTuning>& profile) const {
+        ifstream in(profilePath());
+        string line;
+        while (getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            stringstream fields(line);
+            int bit_depth, num_bins;
+            KernelTuning t;
+            if (fields >> bit_depth >> num_bins >> t.hist_local_size >> t.hist_pixels_per_item >> t.hist_replicas >> t.scan_local_size >>
+                t.apply_local_size >> t.apply_pixels_per_item) {
+                profile[make_pair(bit_depth, num_bins)] = t;
+            }
+        }
+    }
+
+    // Written to a temporary file first, like cached program binaries
+    bool save(const map<pair<int, int>, KernelTuning>& profile) const {
+        error_code ec;
+        filesystem::create_directories(profile_dir, ec);
+        string path = profilePath(), tmp_path = path + ".tmp";
+        ofstream out(tmp_path);
+        out << "# Kernel tuning for " << device.getInfo<CL_DEVICE_NAME>() << " (driver " << device.getInfo<CL_DRIVER_VERSION>() << ")\n"
+            << "# bit_depth bins hist_local_size hist_pixels_per_item hist_replicas scan_local_size apply_local_size apply_pixels_per_item\n";
+        for (const auto& entry : profile) {
+            const KernelTuning& t = entry.second;
+            out << entry.first.first << " " << entry.first.second << " " << t.hist_local_size << " " << t.hist_pixels_per_item << " "
+                << t.hist_replicas << " " << t.scan_local_size << " " << t.apply_local_size << " " << t.apply_pixels_per_item << "\n";
+        }
+        out.close();
+        if (out.fail()) {
+            cerr << "Failed to write " << tmp_path << endl;
+            return false;
+        }
+        filesystem::rename(tmp_path, path, ec);
+        return !ec;
+    }
+
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    bool use_program_cache;
+    string profile_dir, profile_path;
+};
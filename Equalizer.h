@@ -0,0 +1,884 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "Utils.h"
+
+// A device command captured in profiling mode
+struct ProfiledCommand {
+    string name;
+    bool transfer;
+    cl::Event event;
+};
+
+// Tile grid and clip limit of CLAHE mode; a zero grid means global equalization. The clip
+// limit is a multiple of the mean bin count of a tile and 0 disables clipping.
+struct ClaheSettings {
+    int tiles_x = 0, tiles_y = 0;
+    float clip_limit = 2.0f;
+    bool enabled() const { return tiles_x > 0 && tiles_y > 0; }
+};
+
+// Host memory for a zero-copy (CL_MEM_USE_HOST_PTR) buffer. Runtimes only use such memory in
+// place when it is page-aligned and a whole number of cache lines long (pocl, Intel and ARM
+// all check this); otherwise they silently keep a shadow copy and transfer through it, so the
+// memory is allocated here rather than wrapping whatever pointer the caller has.
+class HostStorage {
+public:
+    static constexpr size_t alignment = 4096, granularity = 64;
+
+    // Grows to at least size bytes, discarding the contents; returns true when it reallocated
+    bool reserve(size_t size) {
+        size = (size + granularity - 1) / granularity * granularity;
+        if (data && capacity >= size) {
+            return false;
+        }
+#ifdef _WIN32
+        data.reset(static_cast<unsigned char*>(_aligned_malloc(size, alignment)));
+#else
+        data.reset(static_cast<unsigned char*>(aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)));
+#endif
+        if (!data) {
+            throw bad_alloc();
+        }
+        capacity = size;
+        return true;
+    }
+
+    unsigned char* get() const { return data.get(); }
+    size_t size() const { return capacity; }
+
+private:
+    struct Free {
+        void operator()(unsigned char* p) const {
+#ifdef _WIN32
+            _aligned_free(p);
+#else
+            free(p);
+#endif
+        }
+    };
+    unique_ptr<unsigned char, Free> data;
+    size_t capacity = 0;
+};
+
+// Launch shapes of the histogram, scan and apply kernels, as found per device by the
+// autotuner; zeros keep the built-in defaults. Pixels per work-item set how many work-groups
+// the grid-stride histogram and apply kernels get. hist_replicas is compiled into the program
+// (HIST_REPLICAS), so it is only recorded here for building it; it applies to the separate
+// histogram kernels, which are the ones it was timed with, and not to the fused ones.
+struct KernelTuning {
+    size_t hist_local_size = 0, scan_local_size = 0, apply_local_size = 0;
+    int hist_pixels_per_item = 0, apply_pixels_per_item = 0;
+    int hist_replicas = 1;
+};
+
+// Device-side histogram equalization pipeline.
+// Buffers and kernel objects are created once per context and only reallocated when a
+// larger image or bin count arrives, so processing many channels or many images of the
+// same size performs no device allocations. Stage methods only enqueue work; callers
+// decide when to wait on the queue.
+class Equalizer {
+public:
+    // program must be built with the options from specializationOptions(), with wide_counts
+    // matching the one given here (64-bit histogram and scan counts)
+    Equalizer(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue,
+              const cl::Program& program, int bit_depth, bool wide_counts = false)
+        : context(context), queue(queue), bit_depth(bit_depth), wide_counts(wide_counts) {
+        bool is8 = (bit_depth == 8);
+        hist_kernel = cl::Kernel(program, is8 ? "calculateHistogram" : "calculateHistogram16");
+        fused_hist_kernel = cl::Kernel(program, is8 ? "calculateHistogramFused" : "calculateHistogramFused16");
+        scan_kernel = cl::Kernel(program, is8 ? "prefixSum" : "prefixSum16");
+        hs_scan_kernel = cl::Kernel(program, is8 ? "hillisSteeleScan" : "hillisSteeleScan16");
+        block_sums_kernel = cl::Kernel(program, is8 ? "scanBlockSums" : "scanBlockSums16");
+        add_offsets_kernel = cl::Kernel(program, is8 ? "addBlockOffsets" : "addBlockOffsets16");
+        lut_kernel = cl::Kernel(program, is8 ? "normalizeLUT" : "normalizeLUT16");
+        apply_kernel = cl::Kernel(program, is8 ? "applyLUT" : "applyLUT16");
+        if (!is8) {
+            private_hist_kernel = cl::Kernel(program, "calculateHistogram16Private");
+            luma_private_hist_kernel = cl::Kernel(program, "calculateLumaHistogram16Private");
+            reduce_kernel = cl::Kernel(program, "reduceHistogram16");
+            fused_reduce_kernel = cl::Kernel(program, "reduceHistogramFused16");
+        }
+        unpack_kernel = cl::Kernel(program, is8 ? "unpackPnm" : "unpackPnm16");
+        pack_kernel = cl::Kernel(program, is8 ? "packPnm" : "packPnm16");
+        tile_hist_kernel = cl::Kernel(program, is8 ? "calculateTileHistograms" : "calculateTileHistograms16");
+        tile_lut_kernel = cl::Kernel(program, is8 ? "buildTileLUTs" : "buildTileLUTs16");
+        clahe_kernel = cl::Kernel(program, is8 ? "applyCLAHE" : "applyCLAHE16");
+        luma_hist_kernel = cl::Kernel(program, is8 ? "calculateLumaHistogram" : "calculateLumaHistogram16");
+        luma_apply_kernel = cl::Kernel(program, is8 ? "applyLumaLUT" : "applyLumaLUT16");
+        match_kernel = cl::Kernel(program, is8 ? "matchLUT" : "matchLUT16");
+
+        device_max_wg = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+        device_local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+        local_size = min(device_max_wg, static_cast<size_t>(256));
+        max_scan_local_size = local_size;
+
+        // Histograms wider than the 256-entry local histogram use per-work-group private
+        // sub-histograms in global memory, a few per compute unit, merged by a reduction kernel
+        compute_units = static_cast<int>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+        max_partials = min(compute_units * 4, 128);
+    }
+
+    // Overrides the work-group size of the image kernels (default: up to 256), e.g. for
+    // benchmark sweeps. Clamped to the device limit and to the 256 entries of the kernels'
+    // local arrays. Call before prepare().
+    void setLocalSize(size_t size) {
+        size_t max_wg = min(device_max_wg, static_cast<size_t>(256));
+        local_size = max(static_cast<size_t>(1), min(size, max_wg));
+        max_scan_local_size = max_wg;
+    }
+
+    size_t localSize() const { return local_size; }
+
+    // Per-kernel launch shapes (see KernelTuning). Call before prepare(). A replica count whose
+    // local histograms do not fit the device falls back to 1, as fittingReplicas does.
+    void setTuning(const KernelTuning& tuning) {
+        this->tuning = tuning;
+        this->tuning.hist_replicas = fittingReplicas(device_local_mem, tuning.hist_replicas);
+    }
+
+    // hist_replicas copies of the 256-bin local histogram must fit the device's local memory,
+    // or the program fails to build. A profile reused on a device with less local memory, or
+    // edited by hand, may ask for more; such counts (and non-positive ones) become 1.
+    static int fittingReplicas(cl_ulong local_memory, int replicas) {
+        return (replicas >= 1 && 256 * static_cast<cl_ulong>(replicas) * sizeof(int) <= local_memory) ? replicas : 1;
+    }
+
+    // Sizes the pipeline for a planar image of the given channel count; device buffers are
+    // only reallocated when they must grow. Every stage covers all channels in one launch.
+    // num_bins must match the NUM_BINS the program was specialized for. 8-bit images are
+    // stored as one byte per sample (uchar) and 16-bit ones as unsigned short, on the host
+    // and on the device.
+    void prepare(int total_pixels, int num_bins, int channels = 1) {
+        this->total_pixels = total_pixels;
+        this->num_bins = num_bins;
+        this->channels = channels;
+        hist_channels = luma ? 1 : channels;
+        private_hist = (bit_depth == 16 && num_bins > 256);
+        // Keep the sub-histograms of all channels within 32MB
+        num_partials = max(1, min(max_partials, static_cast<int>((32 << 20) / (hist_channels * num_bins * sizeof(int)))));
+        global_size = ((total_pixels + local_size - 1) / local_size) * local_size;
+        hist_local_size = tunedLocalSize(tuning.hist_local_size);
+        apply_local_size = tunedLocalSize(tuning.apply_local_size);
+
+        // Local-memory histograms grid-stride over uchar16 (8-bit) or ushort8 (16-bit) vectors,
+        // so they only need enough work-groups to fill the device (a few per compute unit), not
+        // one work-item per pixel. Fewer groups also means fewer local-to-global histogram flushes
+        size_t hist_groups;
+        if (tuning.hist_pixels_per_item > 0) {
+            size_t group_pixels = static_cast<size_t>(tuning.hist_pixels_per_item) * hist_local_size;
+            hist_groups = (total_pixels + group_pixels - 1) / group_pixels;
+        } else {
+            size_t vector_width = (bit_depth == 8) ? 16 : 8;
+            size_t vector_groups = (static_cast<size_t>(total_pixels) / vector_width + hist_local_size - 1) / hist_local_size;
+            hist_groups = min(static_cast<size_t>(compute_units) * 4, vector_groups);
+        }
+        hist_global_size = max(static_cast<size_t>(1), hist_groups) * hist_local_size;
+
+        // By default the 8-bit applyLUT maps one uchar16 vector per work-item and the 16-bit one
+        // a single pixel (per plane in luma mode); both grid-stride, so tuning can give each
+        // work-item more
+        size_t apply_items = (bit_depth == 8) ? (total_pixels + 15) / 16 : total_pixels;
+        if (tuning.apply_pixels_per_item > 0) {
+            size_t per_item = (bit_depth == 8) ? max(1, tuning.apply_pixels_per_item / 16) : tuning.apply_pixels_per_item;
+            apply_items = (apply_items + per_item - 1) / per_item;
+        }
+        apply_global_size = max(static_cast<size_t>(1), (apply_items + apply_local_size - 1) / apply_local_size) * apply_local_size;
+
+        // Scans work on power-of-two blocks of up to 256 bins. When num_bins spans several
+        // blocks, the block totals are scanned and added back in the same queue submission,
+        // so any bin count up to 65536 is scanned without a host round trip
+        size_t scan_limit = tuning.scan_local_size > 0 ? min(tuning.scan_local_size, max_scan_local_size) : max_scan_local_size;
+        scan_local_size = 1;
+        while (scan_local_size * 2 <= scan_limit && scan_local_size < static_cast<size_t>(num_bins)) {
+            scan_local_size *= 2;
+        }
+        num_scan_blocks = static_cast<int>((num_bins + scan_local_size - 1) / scan_local_size);
+        scan_global_size = num_scan_blocks * scan_local_size;
+
+        size_t image_size = imageSize();
+        size_t bins_size = static_cast<size_t>(num_bins) * hist_channels * sizeof(int);
+        size_t counts_size = static_cast<size_t>(num_bins) * hist_channels * countSize();
+        bool rebind = false;
+        // In zero-copy mode the buffers the host transfers through wrap aligned host storage:
+        // the planar images, or the payloads in packed mode
+        bool packed_buffers = packed_io && !packedIsPlanar();
+        rebind |= reserveImage(d_input, host_input, CL_MEM_READ_ONLY, image_size, zero_copy && !packed_buffers);
+        rebind |= reserveImage(d_output, host_output, CL_MEM_WRITE_ONLY, image_size, zero_copy && !packed_buffers);
+        rebind |= reserve(d_hist, CL_MEM_READ_WRITE, counts_size);
+        rebind |= reserve(d_cum_hist, CL_MEM_READ_WRITE, counts_size);
+        rebind |= reserve(d_hs_cum_hist, CL_MEM_READ_WRITE, counts_size);
+        rebind |= reserve(d_lut, CL_MEM_READ_WRITE, bins_size);
+        rebind |= reserve(d_block_sums, CL_MEM_READ_WRITE, num_scan_blocks * hist_channels * countSize());
+        if (reserve(d_groups_done, CL_MEM_READ_WRITE, hist_channels * sizeof(int))) {
+            // The fused kernels expect zeroed counters and reset them themselves afterwards
+            queue.enqueueFillBuffer(d_groups_done, 0, 0, hist_channels * sizeof(int));
+            rebind = true;
+        }
+        if (private_hist) {
+            rebind |= reserve(d_partial_hist, CL_MEM_READ_WRITE, static_cast<size_t>(num_partials) * bins_size);
+        }
+        if (matching && target_cdf.size() != static_cast<size_t>(num_bins) * hist_channels) {
+            uploadMatchTarget();
+            rebind = true;
+        }
+        if (packed_buffers) {
+            rebind |= reserveImage(d_packed_input, host_input, CL_MEM_READ_ONLY, image_size, zero_copy);
+            rebind |= reserveImage(d_packed_output, host_output, CL_MEM_WRITE_ONLY, image_size, zero_copy);
+        }
+        if (rebind || !args_bound) {
+            bindBuffers();
+        }
+        bindSizes();
+        args_bound = true;
+    }
+
+    // CLAHE mode: applyCLAHE() equalizes the image tile by tile from clipped per-tile
+    // histograms instead of the global LUT. Call after prepare(); num_bins must be at most 256.
+    void prepareCLAHE(int width, int height, const ClaheSettings& settings) {
+        this->width = width;
+        this->height = height;
+        tile_width = (width + settings.tiles_x - 1) / settings.tiles_x;
+        tile_height = (height + settings.tiles_y - 1) / settings.tiles_y;
+        num_tiles = ((width + tile_width - 1) / tile_width) * ((height + tile_height - 1) / tile_height);
+        clip_limit = settings.clip_limit;
+
+        size_t tiles_size = static_cast<size_t>(num_tiles) * num_bins * channels * sizeof(int);
+        bool rebind = !clahe;
+        rebind |= reserve(d_tile_hist, CL_MEM_READ_WRITE, tiles_size);
+        rebind |= reserve(d_tile_lut, CL_MEM_READ_WRITE, tiles_size);
+        clahe = true;
+        if (rebind) {
+            bindBuffers();
+        }
+        bindSizes();
+    }
+
+    // Profiling mode: every transfer and kernel enqueued from now on records a cl::Event in
+    // profile. The queue must have been created with CL_QUEUE_PROFILING_ENABLE.
+    void enableProfiling() {
+        profiling = true;
+    }
+
+    // Pipelined mode: uploads and downloads go to their own in-order queues instead of the
+    // compute queue, so the transfers of one image overlap the kernels of another. Compute
+    // commands wait on the upload through a barrier and the download waits on a marker placed
+    // after apply(), so callers only have to keep the host pixels alive until download's
+    // event completes. Several Equalizers (one per in-flight image) may share the queues.
+    void useTransferQueues(const cl::CommandQueue& upload_queue, const cl::CommandQueue& download_queue) {
+        this->upload_queue = upload_queue;
+        this->download_queue = download_queue;
+        transfer_queues = true;
+    }
+
+    // Luma mode for RGB images: a single histogram, scan and LUT of the luma (Y of YCbCr),
+    // computed from the three planes on the fly; apply() maps Y through the LUT and shifts R,
+    // G and B by the change, which preserves chroma. The histogram, cumulative histogram and
+    // LUT buffers hold one row. Call before prepare(), which must be given three channels.
+    void enableLuma() {
+        luma = true;
+        args_bound = false;
+    }
+
+    // Histogram matching: normalize() maps the image's histogram onto target instead of onto
+    // a uniform one, by an inverse-CDF search on the device. target holds one target_bins row
+    // per histogram row (channel, or luma), or a single row shared by all of them; it is
+    // rebinned to the pipeline's bin count. Can be called before or after prepare().
+    void setMatchTarget(const vector<long long>& target, int target_bins) {
+        match_target = target;
+        match_bins = target_bins;
+        matching = true;
+        target_cdf.clear();
+        if (args_bound) {
+            uploadMatchTarget();
+            bindBuffers();
+            bindSizes();
+        }
+    }
+
+    bool matchingEnabled() const { return matching; }
+
+    // Packed mode: the caller transfers PGM/PPM payloads (interleaved, big-endian when 16-bit)
+    // with uploadPacked/downloadPacked, and the conversion to and from the planar layout runs
+    // on the device. Call before prepare().
+    void enablePackedTransfers() {
+        packed_io = true;
+        args_bound = false;
+    }
+
+    // Zero-copy mode: the input and output images (the payloads in packed mode) live in host
+    // memory that the Equalizer allocates page-aligned and wraps with CL_MEM_USE_HOST_PTR once,
+    // reallocating only when a larger image arrives. On CPU devices and integrated GPUs the
+    // kernels then read and write that memory in place, and upload/download become map/unmap
+    // calls that copy the caller's pixels in and out on the host, or nothing when the caller
+    // works in hostInput()/hostOutput() directly. Call before prepare().
+    void enableZeroCopy() {
+        zero_copy = true;
+        args_bound = false;
+    }
+
+    // The wrapped host images of zero-copy mode, imageSize() bytes each after prepare(). A
+    // caller may decode into hostInput() and pass it to upload, and pass hostOutput() to
+    // download and read it once the download has completed.
+    unsigned char* hostInput() const { return host_input.get(); }
+    unsigned char* hostOutput() const { return host_output.get(); }
+
+    // Uploads all channel planes at once. With blocking false, pixels must stay valid until
+    // the upload has completed (at the latest when the image's download event completes).
+    void upload(const void* pixels, bool blocking = true) {
+        writeImage(d_input, pixels, imageSize(), blocking, "input");
+    }
+
+    // Uploads a PGM/PPM payload and unpacks it to planar on the device
+    void uploadPacked(const unsigned char* payload, bool blocking = true) {
+        if (packedIsPlanar()) {
+            writeImage(d_input, payload, imageSize(), blocking, "input");
+            return;
+        }
+        writeImage(d_packed_input, payload, imageSize(), blocking, "packed input");
+        queue.enqueueNDRangeKernel(unpack_kernel, cl::NullRange, cl::NDRange(global_size, channels), cl::NDRange(local_size, 1), nullptr, track(unpack_kernel));
+    }
+
+    void histogram() {
+        clearHistogram();
+        countPixels();
+    }
+
+    // Fast path: histogram, cumulative histogram and LUT from a single fused launch
+    void fusedHistogramLUT() {
+        if (luma || matching) {
+            // The fused kernels only build the uniform per-channel LUT
+            histogram();
+            blellochScan();
+            normalize();
+            return;
+        }
+        clearHistogram();
+        if (private_hist) {
+            size_t reduce_global_size = ((num_bins + local_size - 1) / local_size) * local_size;
+            clearSubHistograms();
+            queue.enqueueNDRangeKernel(privateHistKernel(), cl::NullRange, cl::NDRange(num_partials * local_size, hist_channels), cl::NDRange(local_size, 1), nullptr, track(privateHistKernel()));
+            queue.enqueueNDRangeKernel(fused_reduce_kernel, cl::NullRange, cl::NDRange(reduce_global_size, hist_channels), cl::NDRange(local_size, 1), nullptr, track(fused_reduce_kernel));
+        } else {
+            queue.enqueueNDRangeKernel(fused_hist_kernel, cl::NullRange, cl::NDRange(hist_global_size, hist_channels), cl::NDRange(hist_local_size, 1), nullptr, track(fused_hist_kernel));
+        }
+    }
+
+    // Out-of-core mode for images too large for the device: the planar image (image_pixels
+    // per channel) stays in host memory and is streamed twice through the device buffers, which
+    // prepare() sized for one strip of total_pixels pixels per channel. The first pass
+    // accumulates the global histogram strip by strip; after the scan and LUT, the second pass
+    // applies the LUT strip by strip and reads each result into output. Device memory is
+    // bounded by the strip size. Blocks until output holds the equalized image.
+    void equalizeStrips(const void* input, void* output, size_t image_pixels) {
+        size_t strip_pixels = total_pixels;
+        clearHistogram();
+        for (size_t first = 0; first < image_pixels; first += strip_pixels) {
+            int count = static_cast<int>(min(strip_pixels, image_pixels - first));
+            writeStrip(input, image_pixels, first, count);
+            countKernel().setArg(2, count);
+            countPixels();
+        }
+
+        blellochScan();
+        setCountArg(lutKernel(), 2, image_pixels);
+        normalize();
+
+        for (size_t first = 0; first < image_pixels; first += strip_pixels) {
+            int count = static_cast<int>(min(strip_pixels, image_pixels - first));
+            writeStrip(input, image_pixels, first, count);
+            applyKernel().setArg(3, count);
+            apply();
+            readStrip(output, image_pixels, first, count);
+        }
+        queue.finish();
+        bindSizes();
+    }
+
+    // Multi-device mode: this device owns pixels [first, first + total_pixels) of every channel
+    // plane of a host image with image_pixels pixels per channel (a band of rows), with
+    // prepare() given the band size. sliceHistogram uploads the band and counts it into d_hist;
+    // once the host has merged the histograms of all devices into one LUT, applySlice uploads
+    // that LUT, applies it and reads the band back into output. Both only enqueue work, and
+    // input, output and luts must stay valid until the queue has finished.
+    void sliceHistogram(const void* input, size_t image_pixels, size_t first) {
+        writeStrip(input, image_pixels, first, total_pixels);
+        histogram();
+    }
+
+    void applySlice(const int* luts, void* output, size_t image_pixels, size_t first) {
+        queue.enqueueWriteBuffer(d_lut, CL_FALSE, 0, static_cast<size_t>(num_bins) * hist_channels * sizeof(int), luts, nullptr, track("Write LUT", true));
+        apply();
+        readStrip(output, image_pixels, first, total_pixels);
+    }
+
+    void blellochScan() { enqueueScan(scan_kernel, d_cum_hist); }
+    void hillisSteeleScan() { enqueueScan(hs_scan_kernel, d_hs_cum_hist); }
+
+    void normalize() {
+        queue.enqueueNDRangeKernel(lutKernel(), cl::NullRange, cl::NDRange(num_bins, hist_channels), cl::NullRange, nullptr, track(lutKernel()));
+    }
+
+    void apply() {
+        if (luma) {
+            queue.enqueueNDRangeKernel(luma_apply_kernel, cl::NullRange, cl::NDRange(apply_global_size), cl::NDRange(apply_local_size), nullptr, track(luma_apply_kernel));
+            return;
+        }
+        queue.enqueueNDRangeKernel(apply_kernel, cl::NullRange, cl::NDRange(apply_global_size, channels), cl::NDRange(apply_local_size, 1), nullptr, track(apply_kernel));
+    }
+
+    // CLAHE: tile histograms and clipped tile LUTs (one work-group per tile, entirely in local
+    // memory), then the bilinear apply into the output image. Replaces the global stages.
+    void applyCLAHE() {
+        cl::NDRange tile_range(static_cast<size_t>(num_tiles) * local_size, channels);
+        queue.enqueueNDRangeKernel(tile_hist_kernel, cl::NullRange, tile_range, cl::NDRange(local_size, 1), nullptr, track(tile_hist_kernel));
+        queue.enqueueNDRangeKernel(tile_lut_kernel, cl::NullRange, tile_range, cl::NDRange(local_size, 1), nullptr, track(tile_lut_kernel));
+        queue.enqueueNDRangeKernel(clahe_kernel, cl::NullRange, cl::NDRange(global_size, channels), cl::NDRange(local_size, 1), nullptr, track(clahe_kernel));
+    }
+
+    // Downloads all channel planes at once. Returns the event of the last transfer; with
+    // blocking false, pixels only hold the result once it has completed.
+    cl::Event download(void* pixels, bool blocking = true) {
+        return readImage(d_output, pixels, imageSize(), blocking, "output");
+    }
+
+    // Packs the equalized image into a PGM/PPM payload on the device and downloads it
+    cl::Event downloadPacked(unsigned char* payload, bool blocking = true) {
+        if (packedIsPlanar()) {
+            return readImage(d_output, payload, imageSize(), blocking, "output");
+        }
+        queue.enqueueNDRangeKernel(pack_kernel, cl::NullRange, cl::NDRange(global_size, channels), cl::NDRange(local_size, 1), nullptr, track(pack_kernel));
+        return readImage(d_packed_output, payload, imageSize(), blocking, "packed output");
+    }
+
+    // Bytes of one histogram or scan count
+    size_t countSize() const {
+        return wide_counts ? sizeof(cl_ulong) : sizeof(int);
+    }
+
+    // Bytes of one image; the same in planar and packed (PGM/PPM payload) layout
+    size_t imageSize() const {
+        return static_cast<size_t>(total_pixels) * channels * (bit_depth == 8 ? sizeof(unsigned char) : sizeof(unsigned short));
+    }
+
+    // Reads a per-bin buffer for every channel (one num_bins row per channel). Counts are
+    // stored as int, or as 64-bit integers with wide counts, and LUTs always as int; when T
+    // differs from the stored type the values are converted after a blocking read.
+    template <typename T>
+    void readBins(const cl::Buffer& buffer, vector<T>& values, bool blocking = true) {
+        values.resize(num_bins * hist_channels);
+        cl::Event* event = profiling ? track("Read " + binsName(buffer), true) : nullptr;
+        bool wide = wide_counts && buffer() != d_lut();
+        if (sizeof(T) == (wide ? sizeof(cl_ulong) : sizeof(int))) {
+            queue.enqueueReadBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, 0, values.size() * sizeof(T), values.data(), nullptr, event);
+        } else if (wide) {
+            vector<cl_ulong> stored(values.size());
+            queue.enqueueReadBuffer(buffer, CL_TRUE, 0, stored.size() * sizeof(cl_ulong), stored.data(), nullptr, event);
+            copy(stored.begin(), stored.end(), values.begin());
+        } else {
+            vector<int> stored(values.size());
+            queue.enqueueReadBuffer(buffer, CL_TRUE, 0, stored.size() * sizeof(int), stored.data(), nullptr, event);
+            copy(stored.begin(), stored.end(), values.begin());
+        }
+    }
+
+    cl::Buffer d_input, d_output, d_hist, d_cum_hist, d_hs_cum_hist, d_lut;
+    vector<ProfiledCommand> profile;
+
+private:
+    // An 8-bit single-channel payload (PGM) already is the planar device layout
+    bool packedIsPlanar() const {
+        return bit_depth == 8 && channels == 1;
+    }
+
+    // A tuned work-group size within the device limit and the kernels' 256-entry local arrays,
+    // or the common local_size when not tuned
+    size_t tunedLocalSize(size_t size) const {
+        return size > 0 ? min(size, min(device_max_wg, static_cast<size_t>(256))) : local_size;
+    }
+
+    // Sets a count-typed kernel argument (a pixel total) as int or 64-bit to match count_t
+    void setCountArg(cl::Kernel& kernel, cl_uint index, size_t value) {
+        if (wide_counts) {
+            kernel.setArg(index, static_cast<cl_ulong>(value));
+        } else {
+            kernel.setArg(index, static_cast<int>(value));
+        }
+    }
+
+    // Zeroes the histogram the histogram kernels accumulate into
+    void clearHistogram() {
+        queue.enqueueFillBuffer(d_hist, 0, 0, num_bins * hist_channels * countSize(), nullptr, track("Clear histogram", true));
+    }
+
+    void clearSubHistograms() {
+        queue.enqueueFillBuffer(d_partial_hist, 0, 0, static_cast<size_t>(num_partials) * num_bins * hist_channels * sizeof(int), nullptr, track("Clear sub-histograms", true));
+    }
+
+    // Adds the image in d_input to the histogram. The full-range 16-bit histogram counts into
+    // freshly cleared private sub-histograms per work-group, which the reduction then adds to
+    // the histogram, so repeated calls (one per strip) accumulate either way.
+    void countPixels() {
+        if (private_hist) {
+            clearSubHistograms();
+            queue.enqueueNDRangeKernel(privateHistKernel(), cl::NullRange, cl::NDRange(num_partials * local_size, hist_channels), cl::NDRange(local_size, 1), nullptr, track(privateHistKernel()));
+            queue.enqueueNDRangeKernel(reduce_kernel, cl::NullRange, cl::NDRange(num_bins, hist_channels), cl::NullRange, nullptr, track(reduce_kernel));
+        } else if (luma) {
+            queue.enqueueNDRangeKernel(luma_hist_kernel, cl::NullRange, cl::NDRange(hist_global_size), cl::NDRange(hist_local_size), nullptr, track(luma_hist_kernel));
+        } else {
+            queue.enqueueNDRangeKernel(hist_kernel, cl::NullRange, cl::NDRange(hist_global_size, hist_channels), cl::NDRange(hist_local_size, 1), nullptr, track(hist_kernel));
+        }
+    }
+
+    // Kernels that countPixels() and apply() launch over d_input, whose pixel count changes
+    // per strip
+    cl::Kernel& countKernel() {
+        if (private_hist) {
+            return privateHistKernel();
+        }
+        return luma ? luma_hist_kernel : hist_kernel;
+    }
+
+    // Full-range 16-bit sub-histograms of the channels, or of the luma
+    cl::Kernel& privateHistKernel() {
+        return luma ? luma_private_hist_kernel : private_hist_kernel;
+    }
+
+    cl::Kernel& applyKernel() {
+        return luma ? luma_apply_kernel : apply_kernel;
+    }
+
+    cl::Kernel& lutKernel() {
+        return matching ? match_kernel : lut_kernel;
+    }
+
+    // Fixed-point share of pixels (32 fraction bits), as cdfFraction in the kernels
+    static cl_ulong cdfFraction(unsigned long long inclusive, unsigned long long total) {
+        while (total >= (1ULL << 32)) {
+            inclusive >>= 1;
+            total >>= 1;
+        }
+        return total > 0 ? (inclusive << 32) / total : 0;
+    }
+
+    // Rebins match_target to num_bins (merging finer bins, spreading coarser ones), turns every row into inclusive cumulative fractions and
+    // uploads them. Blocking, as it only runs when the target or the pipeline shape changes.
+    void uploadMatchTarget() {
+        int rows = max(1, static_cast<int>(match_target.size() / match_bins));
+        target_cdf.assign(static_cast<size_t>(num_bins) * hist_channels, 0);
+        for (int c = 0; c < hist_channels; c++) {
+            const long long* row = match_target.data() + static_cast<size_t>(min(c, rows - 1)) * match_bins;
+            vector<unsigned long long> counts(num_bins, 0);
+            unsigned long long total = 0;
+            for (int i = 0; i < match_bins; i++) {
+                // A coarser target bin is spread evenly over the fine bins it covers, so the
+                // inverse CDF is not limited to every (num_bins / match_bins)th level
+                size_t lo = static_cast<size_t>(i) * num_bins / match_bins;
+                size_t hi = max(lo + 1, static_cast<size_t>(i + 1) * num_bins / match_bins);
+                unsigned long long count = static_cast<unsigned long long>(row[i]), span = hi - lo;
+                for (size_t j = lo; j < hi; j++) {
+                    counts[j] += count / span + ((j - lo) < count % span ? 1 : 0);
+                }
+                total += row[i];
+            }
+            unsigned long long inclusive = 0;
+            for (int i = 0; i < num_bins; i++) {
+                inclusive += counts[i];
+                target_cdf[static_cast<size_t>(c) * num_bins + i] = cdfFraction(inclusive, total);
+            }
+        }
+        size_t size = target_cdf.size() * sizeof(cl_ulong);
+        reserve(d_target_cdf, CL_MEM_READ_ONLY, size);
+        queue.enqueueWriteBuffer(d_target_cdf, CL_TRUE, 0, size, target_cdf.data(), nullptr, track("Write target CDF", true));
+    }
+
+    // Uploads pixels [first, first + count) of every channel plane of a host image with
+    // image_pixels pixels per channel to d_input, laid out planar with count pixels per channel.
+    // Non-blocking: the host image outlives the strip loop and the in-order queue orders the
+    // reuse of the device buffers.
+    void writeStrip(const void* image, size_t image_pixels, size_t first, int count) {
+        size_t bytes = (bit_depth == 8) ? sizeof(unsigned char) : sizeof(unsigned short);
+        for (int c = 0; c < channels; c++) {
+            const unsigned char* source = static_cast<const unsigned char*>(image) + (c * image_pixels + first) * bytes;
+            queue.enqueueWriteBuffer(d_input, CL_FALSE, static_cast<size_t>(c) * count * bytes, count * bytes, source, nullptr, track("Write input strip", true));
+        }
+    }
+
+    // Downloads the strip in d_output into the same pixels of the host image
+    void readStrip(void* image, size_t image_pixels, size_t first, int count) {
+        size_t bytes = (bit_depth == 8) ? sizeof(unsigned char) : sizeof(unsigned short);
+        for (int c = 0; c < channels; c++) {
+            unsigned char* target = static_cast<unsigned char*>(image) + (c * image_pixels + first) * bytes;
+            queue.enqueueReadBuffer(d_output, CL_FALSE, static_cast<size_t>(c) * count * bytes, count * bytes, target, nullptr, track("Read output strip", true));
+        }
+    }
+
+    // Host-to-device transfer of a whole image buffer: map/unmap in zero-copy mode, otherwise a
+    // write on the upload queue (which the compute queue then waits for) or the compute queue
+    void writeImage(const cl::Buffer& buffer, const void* pixels, size_t size, bool blocking, const string& name) {
+        if (zero_copy) {
+            // A map of a USE_HOST_PTR buffer returns the wrapped pointer, so the copy only
+            // happens when the caller passes pixels other than the wrapped image
+            void* mapped = queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_WRITE, 0, size, nullptr, track("Map " + name, true));
+            if (mapped != pixels) {
+                memcpy(mapped, pixels, size);
+            }
+            queue.enqueueUnmapMemObject(buffer, mapped, nullptr, track("Unmap " + name, true));
+            return;
+        }
+        if (transfer_queues) {
+            cl::Event uploaded;
+            upload_queue.enqueueWriteBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, 0, size, pixels, nullptr, &uploaded);
+            record("Write " + name, uploaded);
+            vector<cl::Event> wait_list{uploaded};
+            queue.enqueueBarrierWithWaitList(&wait_list);
+            return;
+        }
+        queue.enqueueWriteBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, 0, size, pixels, nullptr, track("Write " + name, true));
+    }
+
+    // Device-to-host counterpart of writeImage; the download queue waits for all compute
+    // commands enqueued so far
+    cl::Event readImage(const cl::Buffer& buffer, void* pixels, size_t size, bool blocking, const string& name) {
+        cl::Event downloaded;
+        if (zero_copy) {
+            // The map only has to block when its data is copied out; mapping the wrapped image
+            // itself is just a synchronization point, which the unmap event stands in for
+            cl::Event mapped_event;
+            void* mapped = queue.enqueueMapBuffer(buffer, CL_FALSE, CL_MAP_READ, 0, size, nullptr, &mapped_event);
+            record("Map " + name, mapped_event);
+            if (mapped != pixels) {
+                mapped_event.wait();
+                memcpy(pixels, mapped, size);
+            }
+            queue.enqueueUnmapMemObject(buffer, mapped, nullptr, &downloaded);
+            record("Unmap " + name, downloaded);
+            if (blocking) {
+                downloaded.wait();
+            } else {
+                queue.flush();
+            }
+            return downloaded;
+        }
+        if (transfer_queues) {
+            cl::Event computed;
+            queue.enqueueMarkerWithWaitList(nullptr, &computed);
+            vector<cl::Event> wait_list{computed};
+            download_queue.enqueueReadBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, 0, size, pixels, &wait_list, &downloaded);
+        } else {
+            queue.enqueueReadBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, 0, size, pixels, nullptr, &downloaded);
+        }
+        record("Read " + name, downloaded);
+        return downloaded;
+    }
+
+    // Allocates buffer when it is missing or smaller than size; returns true if it was replaced
+    bool reserve(cl::Buffer& buffer, cl_mem_flags flags, size_t size) {
+        if (buffer() != nullptr && buffer.getInfo<CL_MEM_SIZE>() >= size) {
+            return false;
+        }
+        buffer = cl::Buffer(context, flags, size);
+        return true;
+    }
+
+    // An image buffer, wrapping host storage when wrap is set (zero-copy mode)
+    bool reserveImage(cl::Buffer& buffer, HostStorage& host, cl_mem_flags flags, size_t size, bool wrap) {
+        if (!wrap) {
+            return reserve(buffer, flags, size);
+        }
+        if (!host.reserve(size) && buffer() != nullptr) {
+            return false;
+        }
+        buffer = cl::Buffer(context, flags | CL_MEM_USE_HOST_PTR, host.size(), host.get());
+        return true;
+    }
+
+    void bindBuffers() {
+        hist_kernel.setArg(0, d_input);
+        hist_kernel.setArg(1, d_hist);
+
+        fused_hist_kernel.setArg(0, d_input);
+        fused_hist_kernel.setArg(1, d_hist);
+        fused_hist_kernel.setArg(2, d_cum_hist);
+        fused_hist_kernel.setArg(3, d_lut);
+        fused_hist_kernel.setArg(4, d_groups_done);
+
+        scan_kernel.setArg(0, d_hist);
+        scan_kernel.setArg(1, d_cum_hist);
+        scan_kernel.setArg(2, d_block_sums);
+        hs_scan_kernel.setArg(0, d_hist);
+        hs_scan_kernel.setArg(1, d_hs_cum_hist);
+        hs_scan_kernel.setArg(2, d_block_sums);
+        block_sums_kernel.setArg(0, d_block_sums);
+        add_offsets_kernel.setArg(1, d_block_sums);
+
+        lut_kernel.setArg(0, d_cum_hist);
+        lut_kernel.setArg(1, d_lut);
+
+        apply_kernel.setArg(0, d_input);
+        apply_kernel.setArg(1, d_lut);
+        apply_kernel.setArg(2, d_output);
+
+        if (private_hist) {
+            privateHistKernel().setArg(0, d_input);
+            privateHistKernel().setArg(1, d_partial_hist);
+            reduce_kernel.setArg(0, d_partial_hist);
+            reduce_kernel.setArg(1, d_hist);
+            fused_reduce_kernel.setArg(0, d_partial_hist);
+            fused_reduce_kernel.setArg(1, d_hist);
+            fused_reduce_kernel.setArg(2, d_cum_hist);
+            fused_reduce_kernel.setArg(3, d_lut);
+            fused_reduce_kernel.setArg(4, d_groups_done);
+        }
+
+        if (clahe) {
+            tile_hist_kernel.setArg(0, d_input);
+            tile_hist_kernel.setArg(1, d_tile_hist);
+            tile_lut_kernel.setArg(0, d_tile_hist);
+            tile_lut_kernel.setArg(1, d_tile_lut);
+            clahe_kernel.setArg(0, d_input);
+            clahe_kernel.setArg(1, d_tile_lut);
+            clahe_kernel.setArg(2, d_output);
+        }
+
+        if (matching) {
+            match_kernel.setArg(0, d_cum_hist);
+            match_kernel.setArg(1, d_lut);
+            match_kernel.setArg(3, d_hist);
+            match_kernel.setArg(4, d_target_cdf);
+        }
+
+        if (luma) {
+            luma_hist_kernel.setArg(0, d_input);
+            luma_hist_kernel.setArg(1, d_hist);
+            luma_apply_kernel.setArg(0, d_input);
+            luma_apply_kernel.setArg(1, d_lut);
+            luma_apply_kernel.setArg(2, d_output);
+        }
+
+        if (packed_io && !packedIsPlanar()) {
+            unpack_kernel.setArg(0, d_packed_input);
+            unpack_kernel.setArg(1, d_input);
+            pack_kernel.setArg(0, d_output);
+            pack_kernel.setArg(1, d_packed_output);
+        }
+    }
+
+    void bindSizes() {
+        hist_kernel.setArg(2, total_pixels);
+        fused_hist_kernel.setArg(5, total_pixels);
+
+        scan_kernel.setArg(3, num_bins);
+        hs_scan_kernel.setArg(3, num_bins);
+        block_sums_kernel.setArg(1, num_scan_blocks);
+        add_offsets_kernel.setArg(2, num_bins);
+
+        setCountArg(lutKernel(), 2, total_pixels);
+        apply_kernel.setArg(3, total_pixels);
+
+        if (private_hist) {
+            privateHistKernel().setArg(2, total_pixels);
+            reduce_kernel.setArg(2, num_partials);
+            fused_reduce_kernel.setArg(5, num_partials);
+            fused_reduce_kernel.setArg(6, total_pixels);
+        }
+
+        if (luma) {
+            luma_hist_kernel.setArg(2, total_pixels);
+            luma_apply_kernel.setArg(3, total_pixels);
+        }
+
+        if (packed_io) {
+            unpack_kernel.setArg(2, total_pixels);
+            pack_kernel.setArg(2, total_pixels);
+        }
+
+        if (clahe) {
+            for (cl::Kernel* kernel : {&tile_hist_kernel, &tile_lut_kernel}) {
+                kernel->setArg(2, width);
+                kernel->setArg(3, height);
+                kernel->setArg(4, tile_width);
+                kernel->setArg(5, tile_height);
+            }
+            tile_lut_kernel.setArg(6, clip_limit);
+            clahe_kernel.setArg(3, width);
+            clahe_kernel.setArg(4, height);
+            clahe_kernel.setArg(5, tile_width);
+            clahe_kernel.setArg(6, tile_height);
+        }
+    }
+
+    // Event to attach to the next enqueued command, or nullptr when not profiling. The
+    // pointer is only valid until the next call.
+    cl::Event* track(const string& name, bool transfer = false) {
+        if (!profiling) {
+            return nullptr;
+        }
+        profile.push_back({name, transfer, cl::Event()});
+        return &profile.back().event;
+    }
+
+    // Adds a transfer whose event the caller needed anyway to the profile
+    void record(const string& name, const cl::Event& event) {
+        if (profiling) {
+            profile.push_back({name, true, event});
+        }
+    }
+
+    cl::Event* track(const cl::Kernel& kernel) {
+        return profiling ? track(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>()) : nullptr;
+    }
+
+    string binsName(const cl::Buffer& buffer) const {
+        if (buffer() == d_hist()) return "histogram";
+        if (buffer() == d_cum_hist()) return "cumulative histogram";
+        if (buffer() == d_hs_cum_hist()) return "Hillis-Steele cumulative histogram";
+        if (buffer() == d_lut()) return "LUT";
+        return "bins";
+    }
+
+    // Block scan, then (for multi-block inputs) a scan of the block totals and a uniform add
+    void enqueueScan(cl::Kernel& block_scan, const cl::Buffer& output) {
+        queue.enqueueNDRangeKernel(block_scan, cl::NullRange, cl::NDRange(scan_global_size, hist_channels), cl::NDRange(scan_local_size, 1), nullptr, track(block_scan));
+        if (num_scan_blocks > 1) {
+            add_offsets_kernel.setArg(0, output);
+            queue.enqueueNDRangeKernel(block_sums_kernel, cl::NullRange, cl::NDRange(scan_local_size, hist_channels), cl::NDRange(scan_local_size, 1), nullptr, track(block_sums_kernel));
+            queue.enqueueNDRangeKernel(add_offsets_kernel, cl::NullRange, cl::NDRange(scan_global_size, hist_channels), cl::NDRange(scan_local_size, 1), nullptr, track(add_offsets_kernel));
+        }
+    }
+
+    cl::Context context;
+    cl::CommandQueue queue, upload_queue, download_queue;
+    int bit_depth;
+    bool wide_counts;
+
+    cl::Kernel hist_kernel, fused_hist_kernel, private_hist_kernel, luma_private_hist_kernel, reduce_kernel, fused_reduce_kernel;
+    cl::Kernel scan_kernel, hs_scan_kernel, block_sums_kernel, add_offsets_kernel;
+    cl::Kernel lut_kernel, apply_kernel, unpack_kernel, pack_kernel;
+    cl::Kernel tile_hist_kernel, tile_lut_kernel, clahe_kernel, luma_hist_kernel, luma_apply_kernel, match_kernel;
+    cl::Buffer d_block_sums, d_partial_hist, d_groups_done, d_packed_input, d_packed_output, d_tile_hist, d_tile_lut, d_target_cdf;
+    HostStorage host_input, host_output;
+    vector<long long> match_target;
+    vector<cl_ulong> target_cdf;
+    int match_bins = 0;
+
+    int total_pixels = 0, num_bins = 0, channels = 1, hist_channels = 1;
+    int compute_units = 1, num_partials = 1, max_partials = 1, num_scan_blocks = 1;
+    int width = 0, height = 0, tile_width = 1, tile_height = 1, num_tiles = 0;
+    float clip_limit = 0.0f;
+    bool private_hist = false, clahe = false, args_bound = false, zero_copy = false, profiling = false, transfer_queues = false, packed_io = false, luma = false, matching = false;
+    cl_ulong device_local_mem = 0;
+    size_t device_max_wg = 1, local_size = 1, global_size = 0, hist_global_size = 0, apply_global_size = 0;
+    size_t hist_local_size = 1, apply_local_size = 1;
+    KernelTuning tuning;
+    size_t scan_local_size = 1, max_scan_local_size = 1, scan_global_size = 0;
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <climits>
+#include <exception>
+
+#include "Equalizer.h"
+#include "NativeEqualizer.h"
+
+// Equalizes one image on several OpenCL devices at once (from one or several platforms). The
+// rows are split into one band per device. Each device histograms its band, the host adds the
+// band histograms and builds the single LUT, and every device then applies that LUT to its
+// own band. Band heights follow each device's measured throughput, so a fast GPU gets more
+// rows than a CPU next to it. No band exceeds its device's allocation limit or INT_MAX pixels;
+// rows a device cannot hold go to the others.
+class MultiDeviceEqualizer {
+public:
+    explicit MultiDeviceEqualizer(int bit_depth) : bit_depth(bit_depth) {}
+
+    // program must be built for this device with the options from specializationOptions()
+    void addDevice(const cl::Context& context, const cl::Device& device, const cl::Program& program) {
+        auto slice = make_unique<DeviceSlice>();
+        slice->name = device.getInfo<CL_DEVICE_NAME>();
+        slice->queue = cl::CommandQueue(context, device);
+        slice->equalizer = make_unique<Equalizer>(context, device, slice->queue, program, bit_depth);
+        slice->max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        // Until measured, throughput is estimated from the device's compute units and clock
+        slice->throughput = static_cast<double>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) *
+                            max(1u, static_cast<unsigned>(device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>()));
+        slices.push_back(move(slice));
+    }
+
+    size_t devices() const { return slices.size(); }
+
+    // Returns false when the devices together cannot hold every row of the image
+    bool prepare(int width, int height, int num_bins, int channels) {
+        this->width = width;
+        this->height = height;
+        this->num_bins = num_bins;
+        this->channels = channels;
+        host.prepare(static_cast<size_t>(width) * height, num_bins, channels, bit_depth);
+        // Input and output buffers hold a band of every channel
+        size_t row_bytes = static_cast<size_t>(width) * channels * (bit_depth == 8 ? sizeof(unsigned char) : sizeof(unsigned short));
+        long long capacity = 0;
+        for (auto& slice : slices) {
+            slice->max_rows = static_cast<int>(min(static_cast<size_t>(INT_MAX / width), static_cast<size_t>(slice->max_alloc / row_bytes)));
+            capacity += slice->max_rows;
+        }
+        if (capacity < height) {
+            return false;
+        }
+        split();
+        return true;
+    }
+
+    // Times every device histogramming an equally sized band of its own share of the rows
+    // concurrently and splits the rows by the resulting pixels per second
+    void calibrate(const void* input) {
+        int count = static_cast<int>(slices.size());
+        int probe_rows = max(1, height / (4 * count));
+        for (int d = 0; d < count; d++) {
+            DeviceSlice& slice = *slices[d];
+            slice.first_row = static_cast<int>(static_cast<long long>(d) * height / count);
+            slice.rows = min({probe_rows, slice.max_rows, height - slice.first_row});
+            if (slice.rows > 0) {
+                slice.equalizer->prepare(bandPixels(slice.rows), num_bins, channels);
+            }
+        }
+        runOnDevices([&](DeviceSlice& slice) {
+            slice.equalizer->sliceHistogram(input, pixels(), static_cast<size_t>(slice.first_row) * width);
+        });
+        for (auto& slice : slices) {
+            if (slice->rows == 0) continue;
+            slice->throughput = static_cast<double>(slice->rows) * width / max(slice->seconds, 1e-9);
+        }
+        split();
+    }
+
+    // Equalizes the planar input into output; the merged per-bin rows are returned for the
+    // displays. Each device's measured time on this image refines its throughput for the next.
+    void equalize(const void* input, void* output, vector<long long>& histograms, vector<long long>& cumulative, vector<int>& luts) {
+        for (auto& slice : slices) {
+            if (slice->rows > 0) {
+                slice->equalizer->prepare(bandPixels(slice->rows), num_bins, channels);
+            }
+        }
+
+        runOnDevices([&](DeviceSlice& slice) {
+            slice.equalizer->sliceHistogram(input, pixels(), static_cast<size_t>(slice.first_row) * width);
+            slice.equalizer->readBins(slice.equalizer->d_hist, slice.histogram, false);
+        });
+        histograms.assign(static_cast<size_t>(num_bins) * channels, 0);
+        for (auto& slice : slices) {
+            if (slice->rows == 0) continue;
+            for (size_t i = 0; i < histograms.size(); i++) histograms[i] += slice->histogram[i];
+            slice->histogram_seconds = slice->seconds;
+        }
+
+        // The LUT is tiny, so the host builds it once from the merged counts
+        host.scan(histograms, cumulative);
+        host.normalize(cumulative, luts);
+
+        runOnDevices([&](DeviceSlice& slice) {
+            slice.equalizer->applySlice(luts.data(), output, pixels(), static_cast<size_t>(slice.first_row) * width);
+        });
+        for (auto& slice : slices) {
+            if (slice->rows == 0) continue;
+            slice->throughput = static_cast<double>(slice->rows) * width / max(slice->histogram_seconds + slice->seconds, 1e-9);
+        }
+    }
+
+    // One line per device with its band and measured throughput
+    void printSplit(ostream& out) const {
+        for (const auto& slice : slices) {
+            out << "  " << slice->name << ": rows " << slice->first_row << "-" << slice->first_row + slice->rows
+                << " (" << static_cast<long long>(slice->throughput / 1e6) << " Mpixels/s)" << endl;
+        }
+    }
+
+private:
+    struct DeviceSlice {
+        string name;
+        cl::CommandQueue queue;
+        unique_ptr<Equalizer> equalizer;
+        double throughput = 0, seconds = 0, histogram_seconds = 0;
+        int first_row = 0, rows = 0, max_rows = 0;
+        cl_ulong max_alloc = 0;
+        vector<int> histogram;
+    };
+
+    size_t pixels() const {
+        return static_cast<size_t>(width) * height;
+    }
+
+    // Below INT_MAX by max_rows
+    int bandPixels(int rows) const {
+        return static_cast<int>(static_cast<size_t>(rows) * width);
+    }
+
+    // Hands out contiguous bands of rows in proportion to throughput. A device whose share
+    // exceeds max_rows is clamped to it and the rows it cannot take are shared out again among
+    // the others, until every row has a device (prepare checked that they fit).
+    void split() {
+        size_t count = slices.size();
+        vector<int> rows(count, 0);
+        vector<bool> full(count, false);
+        int remaining = height;
+        while (remaining > 0) {
+            double total = 0;
+            size_t last = count;
+            for (size_t d = 0; d < count; d++) {
+                if (full[d]) continue;
+                total += slices[d]->throughput;
+                last = d;
+            }
+            if (last == count) break;
+            int pool = remaining, handed = 0;
+            double share = 0;
+            for (size_t d = 0; d < count; d++) {
+                if (full[d]) continue;
+                share += slices[d]->throughput / total;
+                int end = (d == last) ? pool : max(handed, min(pool, static_cast<int>(share * pool + 0.5)));
+                int band = end - handed;
+                if (rows[d] + band >= slices[d]->max_rows) {
+                    band = slices[d]->max_rows - rows[d];
+                    full[d] = true;
+                }
+                rows[d] += band;
+                handed = end;
+                remaining -= band;
+            }
+        }
+        int row = 0;
+        for (size_t d = 0; d < count; d++) {
+            slices[d]->first_row = row;
+            slices[d]->rows = rows[d];
+            row += rows[d];
+        }
+    }
+
+    // Runs body for every device with a band on its own host thread and waits for its queue,
+    // recording the seconds each device took; the devices work concurrently. An OpenCL error
+    // on any device is rethrown on the calling thread.
+    template <typename Body>
+    void runOnDevices(Body body) {
+        vector<thread> workers;
+        vector<exception_ptr> errors(slices.size());
+        for (size_t d = 0; d < slices.size(); d++) {
+            if (slices[d]->rows == 0) continue;
+            DeviceSlice* s = slices[d].get();
+            exception_ptr* error = &errors[d];
+            workers.emplace_back([s, error, &body] {
+                try {
+                    auto start = chrono::high_resolution_clock::now();
+                    body(*s);
+                    s->queue.finish();
+                    s->seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+                } catch (...) {
+                    *error = current_exception();
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        for (const auto& error : errors) {
+            if (error) rethrow_exception(error);
+        }
+    }
+
+    int bit_depth;
+    int width = 0, height = 0, num_bins = 256, channels = 1;
+    vector<unique_ptr<DeviceSlice>> slices;
+    NativeEqualizer host{1};  // only builds the LUT, so it needs no worker threads
+};
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+// The AVX2 apply path is compiled into every x86 build with GCC or Clang and picked at run
+// time when the CPU supports it, so the default (SSE2) build still uses it. Other compilers
+// only get it when the whole build targets AVX2 (e.g. /arch:AVX2).
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define NATIVE_AVX2 1
+#define NATIVE_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define NATIVE_AVX2 1
+#define NATIVE_AVX2_TARGET
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// CPU implementation of the equalization pipeline for machines without an OpenCL runtime
+// (selected with -t native, or automatically when no platform is found). It uses the same
+// planar layout (8-bit samples as uchar, 16-bit as unsigned short), bin mapping and LUT
+// formulas as the kernels, and splits every pass across a pool of std::threads that is
+// started once in the constructor, so no pass or image pays for thread creation.
+class NativeEqualizer {
+public:
+    explicit NativeEqualizer(unsigned threads = 0)
+        : num_threads(threads > 0 ? threads : max(1u, thread::hardware_concurrency())) {
+        for (unsigned t = 1; t < num_threads; t++) {
+            workers.emplace_back([this, t] { workerLoop(t); });
+        }
+    }
+    NativeEqualizer(const NativeEqualizer&) = delete;
+    NativeEqualizer& operator=(const NativeEqualizer&) = delete;
+    ~NativeEqualizer() {
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // num_bins is any bin count up to max_value + 1, as with specializationOptions()
+    void prepare(size_t total_pixels, int num_bins, int channels, int bit_depth) {
+        this->total_pixels = total_pixels;
+        this->num_bins = num_bins;
+        this->channels = channels;
+        this->bit_depth = bit_depth;
+        max_value = (bit_depth == 8) ? 255 : 65535;
+        int range = max_value + 1;
+        shift = -1;
+        if (range % num_bins == 0 && ((range / num_bins) & (range / num_bins - 1)) == 0) {
+            shift = 0;
+            while ((1 << shift) < range / num_bins) shift++;
+        }
+    }
+
+    // Each thread counts a contiguous slice of the planes into its own histograms, which are
+    // then summed; no counter is ever shared between threads. Counts are 64-bit so that any
+    // image size fits, as with the device's wide counts.
+    void histogram(const void* pixels, vector<long long>& histograms) {
+        size_t bins_size = static_cast<size_t>(num_bins) * channels;
+        vector<vector<long long>> partial(num_threads, vector<long long>(bins_size, 0));
+        parallelFor(total_pixels * channels, [&](unsigned t, size_t begin, size_t end) {
+            forEachPlaneRange(begin, end, [&](int c, size_t first, size_t last) {
+                long long* hist = partial[t].data() + static_cast<size_t>(c) * num_bins;
+                if (bit_depth == 8) {
+                    countRange(static_cast<const unsigned char*>(pixels), first, last, hist);
+                } else {
+                    countRange(static_cast<const unsigned short*>(pixels), first, last, hist);
+                }
+            });
+        });
+        histograms.assign(bins_size, 0);
+        for (const auto& hist : partial) {
+            for (size_t i = 0; i < bins_size; i++) histograms[i] += hist[i];
+        }
+    }
+
+    // Exclusive scan per channel, as prefixSum
+    void scan(const vector<long long>& histograms, vector<long long>& cumulative) const {
+        cumulative.resize(histograms.size());
+        for (int c = 0; c < channels; c++) {
+            long long sum = 0;
+            for (int i = c * num_bins; i < (c + 1) * num_bins; i++) {
+                cumulative[i] = sum;
+                sum += histograms[i];
+            }
+        }
+    }
+
+    // Same mapping as lutValue in the kernels: cumulative * max_value / total_pixels in 64 bits
+    void normalize(const vector<long long>& cumulative, vector<int>& luts) const {
+        luts.resize(cumulative.size());
+        for (size_t i = 0; i < cumulative.size(); i++) {
+            uint64_t value = total_pixels > 0 ? static_cast<uint64_t>(cumulative[i]) * max_value / total_pixels : 0;
+            luts[i] = static_cast<int>(min(value, static_cast<uint64_t>(max_value)));
+        }
+    }
+
+    // Expands each channel's per-bin LUT to one entry per pixel value, so the apply pass is a
+    // single table lookup (AVX2 gather / NEON tbl) without any binning arithmetic
+    void apply(const void* input, const vector<int>& luts, void* output) {
+        size_t table_size = static_cast<size_t>(max_value) + 1;
+        vector<int32_t> tables(table_size * channels);
+        for (int c = 0; c < channels; c++) {
+            for (size_t v = 0; v < table_size; v++) {
+                tables[c * table_size + v] = luts[static_cast<size_t>(c) * num_bins + binOf(static_cast<uint32_t>(v))];
+            }
+        }
+        parallelFor(total_pixels * channels, [&](unsigned, size_t begin, size_t end) {
+            forEachPlaneRange(begin, end, [&](int c, size_t first, size_t last) {
+                const int32_t* table = tables.data() + c * table_size;
+                if (bit_depth == 8) {
+                    applyRange(static_cast<const unsigned char*>(input) + first, static_cast<unsigned char*>(output) + first, last - first, table);
+                } else {
+                    applyRange(static_cast<const unsigned short*>(input) + first, static_cast<unsigned short*>(output) + first, last - first, table);
+                }
+            });
+        });
+    }
+
+    // Whole pipeline; the intermediate per-bin rows are returned for the displays
+    void equalize(const void* input, void* output, vector<long long>& histograms, vector<long long>& cumulative, vector<int>& luts) {
+        histogram(input, histograms);
+        scan(histograms, cumulative);
+        normalize(cumulative, luts);
+        apply(input, luts, output);
+    }
+
+    // PGM/PPM payload (interleaved, 16-bit big-endian) to planar and back, as unpackPnm / packPnm.
+    // Threads take slices of pixels and walk the channels of each one.
+    void unpack(const unsigned char* payload, void* pixels) {
+        parallelFor(total_pixels, [&](unsigned, size_t begin, size_t end) {
+            for (int c = 0; c < channels; c++) {
+                size_t plane = static_cast<size_t>(c) * total_pixels;
+                if (bit_depth == 8) {
+                    unsigned char* out = static_cast<unsigned char*>(pixels) + plane;
+                    for (size_t i = begin, s = begin * channels + c; i < end; i++, s += channels) {
+                        out[i] = payload[s];
+                    }
+                } else {
+                    unsigned short* out = static_cast<unsigned short*>(pixels) + plane;
+                    for (size_t i = begin, s = begin * channels + c; i < end; i++, s += channels) {
+                        out[i] = static_cast<unsigned short>((payload[2 * s] << 8) | payload[2 * s + 1]);
+                    }
+                }
+            }
+        });
+    }
+
+    void pack(const void* pixels, unsigned char* payload) {
+        parallelFor(total_pixels, [&](unsigned, size_t begin, size_t end) {
+            for (int c = 0; c < channels; c++) {
+                size_t plane = static_cast<size_t>(c) * total_pixels;
+                if (bit_depth == 8) {
+                    const unsigned char* in = static_cast<const unsigned char*>(pixels) + plane;
+                    for (size_t i = begin, s = begin * channels + c; i < end; i++, s += channels) {
+                        payload[s] = in[i];
+                    }
+                } else {
+                    const unsigned short* in = static_cast<const unsigned short*>(pixels) + plane;
+                    for (size_t i = begin, s = begin * channels + c; i < end; i++, s += channels) {
+                        payload[2 * s] = static_cast<unsigned char>(in[i] >> 8);
+                        payload[2 * s + 1] = static_cast<unsigned char>(in[i] & 0xFF);
+                    }
+                }
+            }
+        });
+    }
+
+    unsigned threads() const { return num_threads; }
+
+private:
+    int binOf(uint32_t pixel_value) const {
+        return shift >= 0 ? static_cast<int>(pixel_value >> shift) : static_cast<int>((pixel_value * static_cast<uint32_t>(num_bins)) / (max_value + 1u));
+    }
+
+    // Runs body(thread index, begin, end) over equal slices of [0, count) on the pool, with the
+    // calling thread taking slice 0, and returns once every slice is done
+    template <typename Body>
+    void parallelFor(size_t count, Body body) {
+        size_t chunk = (count + num_threads - 1) / num_threads;
+        function<void(unsigned)> slice = [&](unsigned t) {
+            size_t begin = min(count, t * chunk), end = min(count, begin + chunk);
+            if (begin < end) body(t, begin, end);
+        };
+        if (!workers.empty()) {
+            lock_guard<mutex> lock(pool_mutex);
+            task = &slice;
+            pending = static_cast<unsigned>(workers.size());
+            generation++;
+        }
+        start_cv.notify_all();
+        slice(0);
+        if (!workers.empty()) {
+            unique_lock<mutex> lock(pool_mutex);
+            done_cv.wait(lock, [this] { return pending == 0; });
+            task = nullptr;
+        }
+    }
+
+    // Pool thread t: runs slice t of every task parallelFor publishes until destruction
+    void workerLoop(unsigned t) {
+        unsigned long long seen = 0;
+        while (true) {
+            const function<void(unsigned)>* current;
+            {
+                unique_lock<mutex> lock(pool_mutex);
+                start_cv.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                current = task;
+            }
+            (*current)(t);
+            {
+                lock_guard<mutex> lock(pool_mutex);
+                pending--;
+            }
+            done_cv.notify_one();
+        }
+    }
+
+    // Splits a sample range of the planar image at channel boundaries
+    template <typename Body>
+    void forEachPlaneRange(size_t begin, size_t end, Body body) const {
+        while (begin < end) {
+            int c = static_cast<int>(begin / total_pixels);
+            size_t plane_end = min(end, static_cast<size_t>(c + 1) * total_pixels);
+            body(c, begin, plane_end);
+            begin = plane_end;
+        }
+    }
+
+    template <typename T>
+    void countRange(const T* pixels, size_t first, size_t last, long long* hist) const {
+        if (shift >= 0) {
+            for (size_t i = first; i < last; i++) hist[pixels[i] >> shift]++;
+        } else {
+            for (size_t i = first; i < last; i++) hist[binOf(pixels[i])]++;
+        }
+    }
+
+#if defined(NATIVE_AVX2)
+    static bool hasAVX2() {
+#if defined(__GNUC__) || defined(__clang__)
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#else
+        return true;
+#endif
+    }
+
+    NATIVE_AVX2_TARGET static __m256i load8(const unsigned char* p) { return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))); }
+    NATIVE_AVX2_TARGET static __m256i load8(const unsigned short* p) { return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+
+    // Narrows eight 32-bit values (all within the sample range) and stores them
+    NATIVE_AVX2_TARGET static void store8(unsigned short* p, __m256i v) {
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0xD8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(packed));
+    }
+    NATIVE_AVX2_TARGET static void store8(unsigned char* p, __m256i v) {
+        __m128i words = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0xD8));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi16(words, words));
+    }
+
+    // Gathers eight table entries at a time; returns how many samples it handled
+    template <typename T>
+    NATIVE_AVX2_TARGET static size_t applyRangeAVX2(const T* in, T* out, size_t n, const int32_t* table) {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            store8(out + i, _mm256_i32gather_epi32(table, load8(in + i), 4));
+        }
+        return i;
+    }
+#endif
+
+    template <typename T>
+    static void applyRange(const T* in, T* out, size_t n, const int32_t* table) {
+        size_t i = 0;
+#if defined(NATIVE_AVX2)
+        if (hasAVX2()) {
+            i = applyRangeAVX2(in, out, n, table);
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        // NEON has no gather; 8-bit tables fit in four 64-byte tbl registers instead
+        if (sizeof(T) == 1 && n >= 16) {
+            uint8_t bytes[256];
+            for (int v = 0; v < 256; v++) bytes[v] = static_cast<uint8_t>(table[v]);
+            uint8x16x4_t t0 = {{vld1q_u8(bytes), vld1q_u8(bytes + 16), vld1q_u8(bytes + 32), vld1q_u8(bytes + 48)}};
+            uint8x16x4_t t1 = {{vld1q_u8(bytes + 64), vld1q_u8(bytes + 80), vld1q_u8(bytes + 96), vld1q_u8(bytes + 112)}};
+            uint8x16x4_t t2 = {{vld1q_u8(bytes + 128), vld1q_u8(bytes + 144), vld1q_u8(bytes + 160), vld1q_u8(bytes + 176)}};
+            uint8x16x4_t t3 = {{vld1q_u8(bytes + 192), vld1q_u8(bytes + 208), vld1q_u8(bytes + 224), vld1q_u8(bytes + 240)}};
+            uint8x16_t step = vdupq_n_u8(64);
+            const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+            uint8_t* dst = reinterpret_cast<uint8_t*>(out);
+            for (; i + 16 <= n; i += 16) {
+                // Out-of-range tbl indices yield 0, so each quarter of the table contributes only its own values
+                uint8x16_t idx = vld1q_u8(src + i);
+                uint8x16_t r = vqtbl4q_u8(t0, idx);
+                idx = vsubq_u8(idx, step);
+                r = vorrq_u8(r, vqtbl4q_u8(t1, idx));
+                idx = vsubq_u8(idx, step);
+                r = vorrq_u8(r, vqtbl4q_u8(t2, idx));
+                idx = vsubq_u8(idx, step);
+                r = vorrq_u8(r, vqtbl4q_u8(t3, idx));
+                vst1q_u8(dst + i, r);
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            out[i] = static_cast<T>(table[in[i]]);
+        }
+    }
+
+    unsigned num_threads;
+    vector<thread> workers;
+    mutex pool_mutex;
+    condition_variable start_cv, done_cv;
+    const function<void(unsigned)>* task = nullptr;
+    unsigned long long generation = 0;
+    unsigned pending = 0;
+    bool stopping = false;
+    size_t total_pixels = 0;
+    int num_bins = 256, channels = 1, bit_depth = 8, max_value = 255, shift = 0;
+};
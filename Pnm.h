@@ -0,0 +1,167 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <cstddef>
+#include <cctype>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Copy-on-write memory mapping of a binary PGM (P5) or PPM (P6) file. pixels() points straight
+// at the payload inside the mapping: samples interleaved per pixel, one byte each when
+// max_value < 256, otherwise two bytes each, big-endian. Nothing is decoded on the host. The
+// pages are mapped copy-on-write, so writes through pixels() stay private and never reach the
+// file.
+class PnmImage {
+public:
+    PnmImage() = default;
+    PnmImage(const PnmImage&) = delete;
+    PnmImage& operator=(const PnmImage&) = delete;
+    ~PnmImage() { close(); }
+
+    // Maps filename and parses its header; returns false (leaving the image closed) when the
+    // file cannot be mapped, is not P5/P6 or is shorter than its header says
+    bool open(const string& filename) {
+        close();
+        if (!map(filename)) {
+            // Releases whatever handles the failed mapping had already opened
+            close();
+            return false;
+        }
+        if (!parseHeader() || payload_offset + payloadSize() > size) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap(data, size);
+#endif
+        data = nullptr;
+        size = 0;
+        width = height = channels = max_value = 0;
+    }
+
+    unsigned char* pixels() const { return data + payload_offset; }
+    int bytesPerSample() const { return max_value > 255 ? 2 : 1; }
+    size_t payloadSize() const { return static_cast<size_t>(width) * height * channels * bytesPerSample(); }
+
+    int width = 0, height = 0, channels = 0, max_value = 0;
+
+private:
+    bool map(const string& filename) {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return false;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if (!mapping) return false;
+        data = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+        size = static_cast<size_t>(file_size.QuadPart);
+        return data != nullptr;
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        // The payload is read once front to back by the upload
+        madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+        data = static_cast<unsigned char*>(mapped);
+        size = static_cast<size_t>(st.st_size);
+        return true;
+#endif
+    }
+
+    // Header: magic, width, height and maxval separated by whitespace and '#' comments, then
+    // exactly one whitespace byte before the payload
+    bool parseHeader() {
+        if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) {
+            return false;
+        }
+        channels = (data[1] == '5') ? 1 : 3;
+        size_t pos = 2;
+        int fields[3];
+        for (int& field : fields) {
+            while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+                if (data[pos] == '#') {
+                    while (pos < size && data[pos] != '\n') pos++;
+                } else {
+                    pos++;
+                }
+            }
+            if (pos >= size || !isdigit(data[pos])) return false;
+            long long value = 0;
+            while (pos < size && isdigit(data[pos]) && value <= 0x7fffffff) {
+                value = value * 10 + (data[pos++] - '0');
+            }
+            if (value <= 0 || value > 0x7fffffff) return false;
+            field = static_cast<int>(value);
+        }
+        if (pos >= size || !isspace(data[pos])) return false;
+        width = fields[0];
+        height = fields[1];
+        max_value = fields[2];
+        payload_offset = pos + 1;
+        return max_value <= 65535;
+    }
+
+    unsigned char* data = nullptr;
+    size_t size = 0, payload_offset = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+};
+
+// Streams a binary PGM (one channel) or PPM (three channels): the header is written by open()
+// and the payload, in the same layout as PnmImage::pixels(), by one or more write() calls
+class PnmWriter {
+public:
+    bool open(const string& filename, int width, int height, int channels, int max_value) {
+        out.open(filename, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            return false;
+        }
+        out << (channels == 1 ? "P5" : "P6") << "\n" << width << " " << height << "\n" << max_value << "\n";
+        return out.good();
+    }
+
+    void write(const void* payload, size_t size) {
+        out.write(static_cast<const char*>(payload), size);
+    }
+
+    // Flushes and closes the file; returns false if any write failed
+    bool close() {
+        out.close();
+        return !out.fail();
+    }
+
+private:
+    ofstream out;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+
+#include "Utils.h"
+
+// Build options that specialize the kernels for one bin count and bit depth. Binning becomes a
+// shift when (max_value + 1) / num_bins is a power of two. wide_counts switches histogram and
+// scan counts to 64 bits, and hist_replicas sets the copies of each work-group's local histogram
+// (see KernelTuning). Each combination is a separate program and therefore a separate entry in
+// the binary cache.
+string specializationOptions(int num_bins, int max_value, bool wide_counts = false, int hist_replicas = 1) {
+    int shift = -1;
+    int range = max_value + 1;
+    if (range % num_bins == 0) {
+        int ratio = range / num_bins;
+        if ((ratio & (ratio - 1)) == 0) {
+            shift = 0;
+            while ((1 << shift) < ratio) shift++;
+        }
+    }
+    return "-DNUM_BINS=" + to_string(num_bins) + " -DMAX_VALUE=" + to_string(max_value) + " -DSHIFT=" + to_string(shift) +
+           (wide_counts ? " -DWIDE_COUNTS" : "") + (hist_replicas > 1 ? " -DHIST_REPLICAS=" + to_string(hist_replicas) : "");
+}
+
+// FNV-1a hash used to key cached program binaries
+uint64_t hashString(const string& text, uint64_t hash = 14695981039346656037ULL) {
+    for (unsigned char ch : text) {
+        hash ^= ch;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Path of the cached binary for this source/device/driver/options combination
+string programCachePath(const cl::Device& device, const string& source, const string& options, const string& cache_dir) {
+    uint64_t hash = hashString(source);
+    hash = hashString("\n" + device.getInfo<CL_DEVICE_NAME>(), hash);
+    hash = hashString("\n" + device.getInfo<CL_DRIVER_VERSION>(), hash);
+    hash = hashString("\n" + options, hash);
+    stringstream path;
+    path << cache_dir << "/" << hex << setw(16) << setfill('0') << hash << ".bin";
+    return path.str();
+}
+
+// Builds program from source, or from a binary cached by an earlier run when one exists for the
+// same kernel source, device name, driver version and build options. Freshly compiled binaries
+// are written back to the cache. Returns the build status like cl::Program::build.
+cl_int buildProgramCached(const cl::Context& context, const cl::Device& device, const string& source,
+                          const string& options, cl::Program& program, const string& cache_dir = ".clcache") {
+    string cache_path = programCachePath(device, source, options, cache_dir);
+
+    ifstream cached(cache_path, ios::binary);
+    if (cached.is_open()) {
+        vector<unsigned char> binary((istreambuf_iterator<char>(cached)), istreambuf_iterator<char>());
+        try {
+            program = cl::Program(context, {device}, cl::Program::Binaries{binary});
+            if (program.build({device}, options.c_str()) == CL_SUCCESS) {
+                return CL_SUCCESS;
+            }
+        } catch (const cl::Error& e) {
+            // Stale or incompatible binary: fall through to a source build, which replaces it
+            cerr << "Ignoring cached program binary " << cache_path << ": " << e.what() << " (" << e.err() << ")" << endl;
+        }
+    }
+
+    program = cl::Program(context, source);
+    cl_int err = program.build({device}, options.c_str());
+    if (err != CL_SUCCESS) {
+        return err;
+    }
+
+    // Write to a temporary file first so concurrent runs never read a partial binary
+    vector<vector<unsigned char>> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+    if (!binaries.empty() && !binaries[0].empty()) {
+        error_code ec;
+        filesystem::create_directories(cache_dir, ec);
+        string tmp_path = cache_path + ".tmp";
+        ofstream out(tmp_path, ios::binary);
+        if (out.is_open()) {
+            out.write(reinterpret_cast<const char*>(binaries[0].data()), binaries[0].size());
+            out.close();
+            filesystem::rename(tmp_path, cache_path, ec);
+        }
+    }
+    return CL_SUCCESS;
+}
+
+// Loads OpenCL kernel source code from a file
+string loadKernelSource(const string& filename) {
+    ifstream kernel_file(filename);
+    if (!kernel_file.is_open()) {
+        cerr << "Error opening kernel file: " << filename << endl;
+        exit(1);
+    }
+    stringstream kernel_source;
+    kernel_source << kernel_file.rdbuf();
+    return kernel_source.str();
+}
+
+// Loads the kernel file for bit_depth and builds it specialized for num_bins, reusing the cached
+// binary of an earlier run unless use_program_cache is false. Prints the build log on failure.
+bool buildEqualizerProgram(const cl::Context& context, const cl::Device& device, int bit_depth, int num_bins,
+                           bool use_program_cache, cl::Program& program, bool wide_counts = false, int hist_replicas = 1) {
+    int max_value = (bit_depth == 8) ? 255 : 65535;
+    string kernelSource = loadKernelSource(bit_depth == 8 ? "kernels/8_bit.cl" : "kernels/16_bit.cl");
+    // Kernels are specialized at compile time for this bin count and bit depth
+    string build_options = specializationOptions(num_bins, max_value, wide_counts, hist_replicas);
+    cl_int buildErr;
+    if (use_program_cache) {
+        // Reuse the compiled binary from an earlier run to skip the JIT compile
+        buildErr = buildProgramCached(context, device, kernelSource, build_options, program);
+    } else {
+        program = cl::Program(context, kernelSource);
+        buildErr = program.build({device}, build_options.c_str());
+    }
+    if (buildErr != CL_SUCCESS) {
+        cerr << "Program build error: " << buildErr << endl;
+        cerr << "Build log: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << endl;
+        return false;
+    }
+    return true;
+}
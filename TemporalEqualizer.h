@@ -0,0 +1,140 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+#include "Equalizer.h"
+
+// Host memory allocated by the OpenCL runtime (CL_MEM_ALLOC_HOST_PTR) and mapped once for the
+// buffer's lifetime. Runtimes back it with page-locked memory, so transfers between it and
+// device buffers run as DMA without a staging copy. Used as a pool of frame buffers, which
+// also means streaming frames performs no per-frame allocation.
+class PinnedBuffer {
+public:
+    PinnedBuffer(const cl::Context& context, const cl::CommandQueue& queue, size_t size) : queue(queue) {
+        buffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size);
+        data = static_cast<unsigned char*>(this->queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size));
+    }
+    PinnedBuffer(const PinnedBuffer&) = delete;
+    PinnedBuffer& operator=(const PinnedBuffer&) = delete;
+    ~PinnedBuffer() {
+        try {
+            queue.enqueueUnmapMemObject(buffer, data);
+            queue.finish();
+        } catch (const cl::Error&) {
+        }
+    }
+
+    unsigned char* data = nullptr;
+
+private:
+    cl::CommandQueue queue;
+    cl::Buffer buffer;
+};
+
+// Video mode: equalizes a sequence of same-sized frames with a LUT that follows the scene
+// instead of jumping with every frame. Each frame is histogrammed on the device and blended
+// into an exponentially decayed running histogram (decayHistogram), which also measures how
+// far the running distribution has drifted from the one the current LUT was built from. The
+// LUT is only rebuilt (scan and normalizeLUT on the running histogram) once that drift passes
+// the threshold; every other frame costs an upload, the histogram, the blend, the apply and
+// the download. Histograms stay on the device; only one drift value per channel comes back.
+class TemporalEqualizer {
+public:
+    // program must be built for this device with the options from specializationOptions()
+    TemporalEqualizer(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue,
+                      const cl::Program& program, int bit_depth)
+        : context(context), queue(queue), equalizer(context, device, queue, program, bit_depth) {
+        decay_kernel = cl::Kernel(program, bit_depth == 8 ? "decayHistogram" : "decayHistogram16");
+    }
+
+    // Frames are PGM/PPM payloads instead of planar images. Call before prepare().
+    void enablePackedTransfers() {
+        equalizer.enablePackedTransfers();
+        packed = true;
+    }
+
+    // Per-kernel launch shapes (see KernelTuning). Call before prepare().
+    void setTuning(const KernelTuning& tuning) {
+        equalizer.setTuning(tuning);
+    }
+
+    // decay is the weight the history keeps per frame (0 = every frame on its own, 0.9 = a
+    // time constant of about ten frames); threshold is the drift, as a total variation
+    // distance between 0 and 1, that triggers a LUT rebuild. A decay or threshold of 0
+    // rebuilds the LUT from every frame's own histogram. The blend works in 1/256 steps, so
+    // any decay of at most 1/512 rounds to 0. Restarts the running histogram.
+    void prepare(int total_pixels, int num_bins, int channels, float decay, float threshold) {
+        equalizer.prepare(total_pixels, num_bins, channels);
+        this->channels = channels;
+        this->threshold = threshold;
+        alpha = max(1, min(256, static_cast<int>(lround((1.0f - decay) * 256))));
+        every_frame = (alpha == 256) || threshold <= 0.0f;
+        size_t counts_size = static_cast<size_t>(num_bins) * channels * equalizer.countSize();
+        d_running = cl::Buffer(context, CL_MEM_READ_WRITE, counts_size);
+        d_reference = cl::Buffer(context, CL_MEM_READ_WRITE, counts_size);
+        d_drift = cl::Buffer(context, CL_MEM_WRITE_ONLY, channels * sizeof(float));
+        drift.assign(channels, 0.0f);
+        decay_kernel.setArg(0, equalizer.d_hist);
+        decay_kernel.setArg(1, d_running);
+        decay_kernel.setArg(2, d_reference);
+        decay_kernel.setArg(3, d_drift);
+        frames = rebuilds = 0;
+    }
+
+    // Enqueues one frame and returns the event of its download; input and output must stay
+    // valid until it completes, so the caller can read the next frame meanwhile. The rebuild
+    // decision uses the drift measured on the previous frame, which is back by then, so no
+    // stage waits on the host: a scene change reaches the LUT one frame late. Without history
+    // or threshold there is nothing to wait for, so every frame rebuilds from its own histogram.
+    cl::Event submitFrame(const unsigned char* input, unsigned char* output) {
+        bool rebuild = every_frame || (frames == 0) || *max_element(drift.begin(), drift.end()) > threshold;
+        if (packed) {
+            equalizer.uploadPacked(input, false);
+        } else {
+            equalizer.upload(input, false);
+        }
+        equalizer.histogram();
+        // The first frame replaces the (uninitialized) running histogram outright
+        decay_kernel.setArg(4, frames == 0 ? 256 : alpha);
+        size_t local_size = equalizer.localSize();
+        queue.enqueueNDRangeKernel(decay_kernel, cl::NullRange, cl::NDRange(local_size, channels), cl::NDRange(local_size, 1));
+        if (rebuild) {
+            equalizer.blellochScan();
+            equalizer.normalize();
+            queue.enqueueCopyBuffer(equalizer.d_hist, d_reference, 0, 0, d_reference.getInfo<CL_MEM_SIZE>());
+            rebuilds++;
+        }
+        equalizer.apply();
+        queue.enqueueReadBuffer(d_drift, CL_FALSE, 0, drift.size() * sizeof(float), drift.data());
+        frames++;
+        rebuilt = rebuild;
+        return packed ? equalizer.downloadPacked(output, false) : equalizer.download(output, false);
+    }
+
+    // Called once the frame's event has completed. The drift of a frame that rebuilt the LUT
+    // was measured against the old reference, so it is discarded.
+    void finishFrame() {
+        if (rebuilt) {
+            fill(drift.begin(), drift.end(), 0.0f);
+        }
+    }
+
+    size_t imageSize() const { return equalizer.imageSize(); }
+    long long frameCount() const { return frames; }
+    long long rebuildCount() const { return rebuilds; }
+
+private:
+    cl::Context context;
+    cl::CommandQueue queue;
+    Equalizer equalizer;
+    cl::Kernel decay_kernel;
+    cl::Buffer d_running, d_reference, d_drift;
+    vector<float> drift;
+    int channels = 1, alpha = 256;
+    float threshold = 0.0f;
+    bool packed = false, rebuilt = false, every_frame = false;
+    long long frames = 0, rebuilds = 0;
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cctype>
+#include <exception>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+// Frame layouts of video mode. Pnm streams are concatenated binary PGM/PPM images, each with
+// its own header. The raw layouts have no headers and take their size from the command line:
+// gray8 and gray16le (little-endian) are single planes, and yuv420p (I420) is a full-size Y
+// plane followed by quarter-size U and V planes, of which only Y is equalized.
+enum class FrameFormat { Pnm, Gray8, Gray16LE, Yuv420p };
+
+struct VideoFormat {
+    FrameFormat format = FrameFormat::Pnm;
+    int width = 0, height = 0;
+
+    // Parses a raw layout given as <width>x<height>:<gray8|gray16le|yuv420p>
+    bool parse(const string& spec) {
+        size_t x = spec.find('x'), colon = spec.find(':');
+        if (x == string::npos || colon == string::npos || colon < x) return false;
+        try {
+            width = stoi(spec.substr(0, x));
+            height = stoi(spec.substr(x + 1, colon - x - 1));
+        } catch (const exception&) {
+            return false;
+        }
+        string name = spec.substr(colon + 1);
+        if (name == "gray8") format = FrameFormat::Gray8;
+        else if (name == "gray16le") format = FrameFormat::Gray16LE;
+        else if (name == "yuv420p") format = FrameFormat::Yuv420p;
+        else return false;
+        return width > 0 && height > 0;
+    }
+};
+
+// Opens path for binary reading or writing, with "-" meaning stdin or stdout
+inline FILE* openStream(const string& path, bool write) {
+    if (path == "-") {
+        FILE* stream = write ? stdout : stdin;
+#ifdef _WIN32
+        _setmode(_fileno(stream), _O_BINARY);
+#endif
+        return stream;
+    }
+    return fopen(path.c_str(), write ? "wb" : "rb");
+}
+
+// Reads the frames of a video stream one after another. Every frame must have the size,
+// channel count and bit depth of the first one; the frame buffer is only resized when the
+// first frame arrives, so steady-state reading allocates nothing.
+class FrameReader {
+public:
+    FrameReader() = default;
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+    ~FrameReader() { close(); }
+
+    bool open(const string& path, const VideoFormat& format) {
+        close();
+        this->format = format.format;
+        if (format.format != FrameFormat::Pnm) {
+            width = format.width;
+            height = format.height;
+            channels = 1;
+            bit_depth = (format.format == FrameFormat::Gray16LE) ? 16 : 8;
+        }
+        file = openStream(path, false);
+        owned = (file && file != stdin);
+        return file != nullptr;
+    }
+
+    void close() {
+        if (owned) fclose(file);
+        file = nullptr;
+        owned = false;
+    }
+
+    // Reads the next frame into frame; returns false at the end of the stream or on a
+    // malformed or truncated frame, which also sets error
+    bool next(vector<unsigned char>& frame) {
+        if (!readHeader()) return false;
+        frame.resize(frameSize());
+        return readPayload(frame.data());
+    }
+
+    // Same, into caller-owned memory (e.g. a pinned buffer) of at least frameSize() bytes
+    bool next(unsigned char* frame) {
+        return readHeader() && readPayload(frame);
+    }
+
+    // Bytes of one frame, and of the part of it that is equalized (the Y plane of yuv420p,
+    // otherwise the whole frame)
+    size_t frameSize() const {
+        if (format == FrameFormat::Yuv420p) {
+            return equalizedSize() + 2 * static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2);
+        }
+        return equalizedSize();
+    }
+
+    size_t equalizedSize() const {
+        return static_cast<size_t>(width) * height * channels * (bit_depth == 16 ? 2 : 1);
+    }
+
+    FrameFormat format = FrameFormat::Pnm;
+    int width = 0, height = 0, channels = 1, bit_depth = 8;
+    bool error = false;
+    long long bytes_read = 0;
+
+private:
+    bool readHeader() {
+        return file && (format != FrameFormat::Pnm || readPnmHeader());
+    }
+
+    // Reads one frame's samples; fread keeps reading a pipe or FIFO until the frame is
+    // complete or the writer has closed it
+    bool readPayload(unsigned char* frame) {
+        size_t got = fread(frame, 1, frameSize(), file);
+        bytes_read += got;
+        if (got != frameSize()) {
+            // A stream that ends exactly between raw frames is a clean end
+            error = (got > 0 || format == FrameFormat::Pnm);
+            return false;
+        }
+        return true;
+    }
+
+    // Same header syntax as PnmImage; a stream that ends before the magic of the next frame
+    // is a clean end
+    bool readPnmHeader() {
+        int ch = fgetc(file);
+        while (ch != EOF && isspace(ch)) ch = fgetc(file);
+        if (ch == EOF) return false;
+        int kind = fgetc(file);
+        if (ch != 'P' || (kind != '5' && kind != '6')) {
+            error = true;
+            return false;
+        }
+        int fields[3];
+        ch = fgetc(file);
+        for (int& field : fields) {
+            while (ch != EOF && (isspace(ch) || ch == '#')) {
+                if (ch == '#') {
+                    while (ch != EOF && ch != '\n') ch = fgetc(file);
+                }
+                ch = fgetc(file);
+            }
+            long long value = 0;
+            while (ch != EOF && isdigit(ch) && value <= 0x7fffffff) {
+                value = value * 10 + (ch - '0');
+                ch = fgetc(file);
+            }
+            if (value <= 0 || value > 0x7fffffff) {
+                error = true;
+                return false;
+            }
+            field = static_cast<int>(value);
+        }
+        // ch is the single whitespace byte before the payload
+        int frame_channels = (kind == '5') ? 1 : 3, frame_depth = (fields[2] > 255) ? 16 : 8;
+        if (!isspace(ch) || fields[2] > 65535) {
+            error = true;
+            return false;
+        }
+        if (frames_read > 0 && (fields[0] != width || fields[1] != height || frame_channels != channels || frame_depth != bit_depth)) {
+            error = true;
+            return false;
+        }
+        width = fields[0];
+        height = fields[1];
+        channels = frame_channels;
+        bit_depth = frame_depth;
+        frames_read++;
+        return true;
+    }
+
+    FILE* file = nullptr;
+    bool owned = false;
+    long long frames_read = 0;
+};
+
+// Writes equalized frames in the layout they were read in (PGM/PPM frames get a header each)
+class FrameWriter {
+public:
+    FrameWriter() = default;
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+    ~FrameWriter() { close(); }
+
+    bool open(const string& path) {
+        file = openStream(path, true);
+        owned = (file && file != stdout);
+        return file != nullptr;
+    }
+
+    // Writes the equalized part of a frame followed by the untouched rest (the chroma planes
+    // of yuv420p)
+    void write(const FrameReader& reader, const unsigned char* equalized, const unsigned char* rest) {
+        if (reader.format == FrameFormat::Pnm) {
+            fprintf(file, "%s\n%d %d\n%d\n", reader.channels == 1 ? "P5" : "P6", reader.width, reader.height,
+                    reader.bit_depth == 8 ? 255 : 65535);
+        }
+        fwrite(equalized, 1, reader.equalizedSize(), file);
+        if (reader.frameSize() > reader.equalizedSize()) {
+            fwrite(rest, 1, reader.frameSize() - reader.equalizedSize(), file);
+        }
+    }
+
+    // Flushes and closes the stream; returns false if any write failed
+    bool close() {
+        if (!file) return true;
+        bool ok = (fflush(file) == 0 && !ferror(file));
+        if (owned) ok &= (fclose(file) == 0);
+        file = nullptr;
+        owned = false;
+        return ok;
+    }
+
+private:
+    FILE* file = nullptr;
+    bool owned = false;
+};
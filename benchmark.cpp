@@ -0,0 +1,312 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <climits>
+#include "Utils.h"
+#include "Equalizer.h"
+#include "ProgramCache.h"
+
+using namespace std;
+
+// Benchmark harness: equalizes synthetic images on one device over a sweep of sizes, bit
+// depths, pixel distributions, bin counts, work-group sizes and kernel variants. Every
+// configuration is run a few times untimed (warm-up) and then repeatedly with device event
+// profiling, and the median and 95th percentile of every stage go to JSON and/or CSV so that
+// runs on different drivers or commits can be compared.
+
+struct BenchmarkResult {
+    int bit_depth, size, num_bins;
+    size_t local_size;
+    string distribution, variant, stage;
+    double median_ns, p95_ns;
+    int runs;
+};
+
+// Splits a comma-separated list
+vector<string> splitList(const string& text) {
+    vector<string> items;
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+vector<int> splitInts(const string& text) {
+    vector<int> values;
+    for (const auto& item : splitList(text)) values.push_back(stoi(item));
+    return values;
+}
+
+// size x size single-channel image: "uniform" over the whole range, "skewed" towards dark
+// values (most pixels in the lowest bins), or "single" with every pixel equal, which sends
+// all histogram atomics to one bin
+template <typename T>
+void fillSynthetic(vector<T>& pixels, const string& distribution, int max_value, unsigned seed) {
+    mt19937 rng(seed);
+    if (distribution == "single") {
+        fill(pixels.begin(), pixels.end(), static_cast<T>(max_value / 2));
+    } else if (distribution == "skewed") {
+        uniform_real_distribution<float> u(0.0f, 1.0f);
+        for (auto& p : pixels) {
+            float x = u(rng);
+            p = static_cast<T>(x * x * x * x * max_value);
+        }
+    } else {
+        uniform_int_distribution<int> u(0, max_value);
+        for (auto& p : pixels) p = static_cast<T>(u(rng));
+    }
+}
+
+// Nearest-rank percentile of unsorted samples
+double percentile(vector<double> samples, double p) {
+    sort(samples.begin(), samples.end());
+    size_t rank = static_cast<size_t>(ceil(p / 100.0 * samples.size()));
+    return samples[min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// One timed pass of a variant: the device time of every profiled command, summed per stage
+// name, plus the host wall time of the whole pass as "Total (host)". "staged" is the
+// histogram/Blelloch scan/LUT/apply sequence and "fused" is the -f fast path. "hillis" times
+// the Hillis-Steele scan alone: its 16-bit form is inclusive where the LUT expects Blelloch's
+// exclusive counts, so the pass stops after the scan and reports only the scan's commands.
+map<string, double> runOnce(Equalizer& equalizer, const string& variant, const void* input, void* output) {
+    equalizer.profile.clear();
+    auto start = chrono::high_resolution_clock::now();
+    equalizer.upload(input, false);
+    size_t first_command = 0;
+    if (variant == "fused") {
+        equalizer.fusedHistogramLUT();
+    } else if (variant == "hillis") {
+        equalizer.histogram();
+        first_command = equalizer.profile.size();
+        equalizer.hillisSteeleScan();
+        // The queue is in order, so the scan's last command finishes the pass
+        equalizer.profile.back().event.wait();
+    } else {
+        equalizer.histogram();
+        equalizer.blellochScan();
+        equalizer.normalize();
+    }
+    if (variant != "hillis") {
+        equalizer.apply();
+        equalizer.download(output);
+    }
+    auto end = chrono::high_resolution_clock::now();
+
+    map<string, double> stages;
+    for (size_t i = first_command; i < equalizer.profile.size(); i++) {
+        const auto& command = equalizer.profile[i];
+        cl_ulong start_ns = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong end_ns = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        stages[command.name] += static_cast<double>(end_ns - start_ns);
+    }
+    if (variant == "hillis") {
+        return stages;
+    }
+    stages["Total (host)"] = static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+    return stages;
+}
+
+string jsonEscape(const string& text) {
+    string escaped;
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') escaped += '\\';
+        escaped += ch;
+    }
+    return escaped;
+}
+
+void writeCsv(const string& filename, const vector<BenchmarkResult>& results) {
+    ofstream out(filename);
+    out << "bit_depth,size,distribution,bins,local_size,variant,stage,median_ns,p95_ns,runs\n";
+    for (const auto& r : results) {
+        out << r.bit_depth << "," << r.size << "," << r.distribution << "," << r.num_bins << "," << r.local_size << ","
+            << r.variant << ",\"" << r.stage << "\"," << static_cast<long long>(r.median_ns) << ","
+            << static_cast<long long>(r.p95_ns) << "," << r.runs << "\n";
+    }
+}
+
+void writeJson(const string& filename, const cl::Device& device, const vector<BenchmarkResult>& results) {
+    ofstream out(filename);
+    out << "{\n  \"device\": \"" << jsonEscape(device.getInfo<CL_DEVICE_NAME>()) << "\",\n"
+        << "  \"driver\": \"" << jsonEscape(device.getInfo<CL_DRIVER_VERSION>()) << "\",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"bit_depth\": " << r.bit_depth << ", \"size\": " << r.size
+            << ", \"distribution\": \"" << r.distribution << "\", \"bins\": " << r.num_bins
+            << ", \"local_size\": " << r.local_size << ", \"variant\": \"" << r.variant
+            << "\", \"stage\": \"" << jsonEscape(r.stage) << "\", \"median_ns\": " << static_cast<long long>(r.median_ns)
+            << ", \"p95_ns\": " << static_cast<long long>(r.p95_ns) << ", \"runs\": " << r.runs << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Prints command-line usage instructions
+void print_help() {
+    cerr << "Usage: benchmark [options]\n"
+         << "  -p <platform>                      platform index, default 0\n"
+         << "  -d <device>                        device index, default 0\n"
+         << "  -sizes <n,...>                     square image sides, default 256,1024,4096,16384\n"
+         << "  -depths <8,16>                     bit depths, default both\n"
+         << "  -dists <uniform,skewed,single>     pixel distributions, default all\n"
+         << "  -bins <n,...>                      bin counts, default 64,256 for 8-bit and 256,4096,65536 for 16-bit\n"
+         << "  -wg <n,...>                        work-group sizes, default 64,128,256\n"
+         << "  -variants <staged,hillis,fused>    kernel variants, default all\n"
+         << "  -warmup <n>                        untimed runs, default 2\n"
+         << "  -reps <n>                          timed runs, default 10\n"
+         << "  -json <file>                       write results as JSON\n"
+         << "  -csv <file>                        write results as CSV\n"
+         << "  -nc                                no program binary cache\n"
+         << "  -h                                 this help\n";
+}
+
+int main(int argc, char** argv) {
+    int selected_platform = 0, selected_device = 0, warmup = 2, repetitions = 10;
+    vector<int> sizes = {256, 1024, 4096, 16384}, depths = {8, 16}, bins_list, local_sizes = {64, 128, 256};
+    vector<string> distributions = {"uniform", "skewed", "single"}, variants = {"staged", "hillis", "fused"};
+    string json_file, csv_file;
+    bool use_program_cache = true;
+
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "-h") { print_help(); return 0; }
+        if (string(argv[i]) == "-p" && i + 1 < argc) { selected_platform = stoi(argv[++i]); }
+        if (string(argv[i]) == "-d" && i + 1 < argc) { selected_device = stoi(argv[++i]); }
+        if (string(argv[i]) == "-sizes" && i + 1 < argc) { sizes = splitInts(argv[++i]); }
+        if (string(argv[i]) == "-depths" && i + 1 < argc) { depths = splitInts(argv[++i]); }
+        if (string(argv[i]) == "-dists" && i + 1 < argc) { distributions = splitList(argv[++i]); }
+        if (string(argv[i]) == "-bins" && i + 1 < argc) { bins_list = splitInts(argv[++i]); }
+        if (string(argv[i]) == "-wg" && i + 1 < argc) { local_sizes = splitInts(argv[++i]); }
+        if (string(argv[i]) == "-variants" && i + 1 < argc) { variants = splitList(argv[++i]); }
+        if (string(argv[i]) == "-warmup" && i + 1 < argc) { warmup = stoi(argv[++i]); }
+        if (string(argv[i]) == "-reps" && i + 1 < argc) { repetitions = max(1, stoi(argv[++i])); }
+        if (string(argv[i]) == "-json" && i + 1 < argc) { json_file = argv[++i]; }
+        if (string(argv[i]) == "-csv" && i + 1 < argc) { csv_file = argv[++i]; }
+        if (string(argv[i]) == "-nc") { use_program_cache = false; }
+    }
+
+    try {
+        vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        if (selected_platform >= static_cast<int>(platforms.size())) {
+            cerr << "Invalid platform index: " << selected_platform << endl;
+            return 1;
+        }
+        vector<cl::Device> devices;
+        platforms[selected_platform].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        if (selected_device >= static_cast<int>(devices.size())) {
+            cerr << "Invalid device index: " << selected_device << endl;
+            return 1;
+        }
+        cl::Device device = devices[selected_device];
+        cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[selected_platform])(), 0};
+        cl::Context context({device}, properties);
+        cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+        size_t max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        cout << "Device: " << device.getInfo<CL_DEVICE_NAME>() << " (driver " << device.getInfo<CL_DRIVER_VERSION>() << ")" << endl;
+
+        vector<BenchmarkResult> results;
+        for (int bit_depth : depths) {
+            int max_value = (bit_depth == 8) ? 255 : 65535;
+            // One program and one Equalizer per bin count, reused for every size, distribution,
+            // work-group size and variant: buffers only grow, so allocations stay out of the runs
+            map<int, cl::Program> programs;
+            map<int, unique_ptr<Equalizer>> equalizers;
+            vector<int> depth_bins = bins_list.empty() ? (bit_depth == 8 ? vector<int>{64, 256} : vector<int>{256, 4096, 65536}) : bins_list;
+            for (int size : sizes) {
+                size_t total_pixels = static_cast<size_t>(size) * size;
+                size_t image_size = total_pixels * (bit_depth == 8 ? sizeof(unsigned char) : sizeof(unsigned short));
+                if (total_pixels > INT_MAX || image_size > max_alloc) {
+                    cout << "Skipping " << size << "x" << size << " " << bit_depth << "-bit: larger than one device allocation" << endl;
+                    continue;
+                }
+                vector<unsigned char> input8, output8;
+                vector<unsigned short> input16, output16;
+                for (const auto& distribution : distributions) {
+                    const void* input;
+                    void* output;
+                    if (bit_depth == 8) {
+                        input8.resize(total_pixels);
+                        output8.resize(total_pixels);
+                        fillSynthetic(input8, distribution, max_value, size);
+                        input = input8.data();
+                        output = output8.data();
+                    } else {
+                        input16.resize(total_pixels);
+                        output16.resize(total_pixels);
+                        fillSynthetic(input16, distribution, max_value, size);
+                        input = input16.data();
+                        output = output16.data();
+                    }
+
+                    for (int num_bins : depth_bins) {
+                        if (num_bins < 1 || num_bins > max_value + 1) continue;
+                        unique_ptr<Equalizer>& shared = equalizers[num_bins];
+                        if (!shared) {
+                            if (!buildEqualizerProgram(context, device, bit_depth, num_bins, use_program_cache, programs[num_bins])) {
+                                return 1;
+                            }
+                            shared = make_unique<Equalizer>(context, device, queue, programs[num_bins], bit_depth);
+                            shared->enableProfiling();
+                        }
+                        Equalizer& equalizer = *shared;
+                        for (int requested_local_size : local_sizes) {
+                            for (const auto& variant : variants) {
+                                equalizer.setLocalSize(requested_local_size);
+                                equalizer.prepare(static_cast<int>(total_pixels), num_bins);
+
+                                for (int w = 0; w < warmup; w++) {
+                                    runOnce(equalizer, variant, input, output);
+                                }
+                                // Summary line: host wall time, or the summed scan commands for "hillis"
+                                map<string, vector<double>> samples;
+                                vector<double> totals;
+                                for (int r = 0; r < repetitions; r++) {
+                                    double device_total = 0;
+                                    auto stages = runOnce(equalizer, variant, input, output);
+                                    for (const auto& stage : stages) {
+                                        samples[stage.first].push_back(stage.second);
+                                        device_total += stage.second;
+                                    }
+                                    totals.push_back(stages.count("Total (host)") ? stages["Total (host)"] : device_total);
+                                }
+
+                                for (const auto& stage : samples) {
+                                    results.push_back({bit_depth, size, num_bins, equalizer.localSize(), distribution, variant, stage.first,
+                                                       percentile(stage.second, 50), percentile(stage.second, 95), static_cast<int>(stage.second.size())});
+                                }
+                                cout << bit_depth << "-bit " << size << "x" << size << " " << distribution << ", " << num_bins << " bins, wg "
+                                     << equalizer.localSize() << ", " << variant << ": median "
+                                     << static_cast<long long>(percentile(totals, 50) / 1000) << "us, p95 "
+                                     << static_cast<long long>(percentile(totals, 95) / 1000) << "us" << endl;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        if (!csv_file.empty()) {
+            writeCsv(csv_file, results);
+            cout << "Wrote " << results.size() << " rows to " << csv_file << endl;
+        }
+        if (!json_file.empty()) {
+            writeJson(json_file, device, results);
+            cout << "Wrote " << results.size() << " results to " << json_file << endl;
+        }
+    } catch (const cl::Error& e) {
+        cerr << "OpenCL error: " << e.what() << " (" << getErrorString(e.err()) << ")" << endl;
+        return 1;
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,70 +1,353 @@
+// Multi-channel images are stored planar (one totalPixels-long plane per channel, as in
+// CImg) and every NDRange uses dimension 1 to select the channel, so each stage processes
+// all channels in a single launch. Histograms, cumulative histograms and LUTs are laid out
+// as one NUM_BINS-long row per channel.
+
+// Bin count, maximum pixel value and binning shift are compile-time constants supplied by
+// the host as -DNUM_BINS=... -DMAX_VALUE=... -DSHIFT=...; SHIFT is log2((MAX_VALUE + 1) / NUM_BINS)
+// when that ratio is a power of two and -1 otherwise, so binning is a single shift whenever possible.
+#ifndef NUM_BINS
+#define NUM_BINS 256
+#endif
+#ifndef MAX_VALUE
+#define MAX_VALUE 65535
+#endif
+#ifndef SHIFT
+#define SHIFT 8
+#endif
+
+// Copies of the local histogram per work-group, supplied as -DHIST_REPLICAS=... (chosen by the
+// autotuner). Work-item i counts into copy i % HIST_REPLICAS, which spreads the atomics of a
+// busy bin over several addresses; the copies are summed when the group flushes its counts.
+// Only the separate histogram kernels use them: the fused kernels, which the autotuner does
+// not time, keep a single copy next to their scan array.
+// Local histograms hold LOCAL_BINS bins, as the local-memory kernels only run for up to 256.
+#ifndef HIST_REPLICAS
+#define HIST_REPLICAS 1
+#endif
+#define LOCAL_BINS (NUM_BINS < 256 ? NUM_BINS : 256)
+
+// Histogram, cumulative histogram and scan counts are 32-bit ints unless the host defines
+// WIDE_COUNTS for images with more than INT_MAX pixels per channel. Work-group local
+// histograms stay 32-bit either way and are flushed into the global counts by addCount.
+#ifdef WIDE_COUNTS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+typedef ulong count_t;
+#else
+typedef int count_t;
+#endif
+
+// Adds a work-group's local count to a global histogram bin
+void addCount(__global count_t* bin, int count) {
+#ifdef WIDE_COUNTS
+    atom_add(bin, (ulong)count);
+#else
+    atomic_add(bin, count);
+#endif
+}
+
+// Stores a finished count with an atomic, so that it is visible to the last work-group of a
+// fused launch, which reads it back (volatile) once the groupsDone counter says all are done
+void publishCount(__global count_t* bin, count_t count) {
+#ifdef WIDE_COUNTS
+    atom_xchg(bin, count);
+#else
+    atomic_xchg(bin, count);
+#endif
+}
+
+// Maps an exclusive cumulative count to its equalized value. The product is taken in 64 bits,
+// so cumulative * MAX_VALUE cannot overflow however large the image is.
+int lutValue(count_t cumulative, count_t totalPixels) {
+    return (totalPixels > 0) ? (int)min((ulong)cumulative * MAX_VALUE / (ulong)totalPixels, (ulong)MAX_VALUE) : 0;
+}
+
+// Maps a pixel value to its histogram bin
+int binOf(uint pixelValue) {
+#if SHIFT >= 0
+    return pixelValue >> SHIFT;
+#else
+    return (pixelValue * NUM_BINS) / (MAX_VALUE + 1);
+#endif
+}
+
+// Counts this work-item's share of an image plane into localHist. The NDRange is sized from
+// the device's compute units rather than the image, so work-items walk the plane with a grid
+// stride over ushort8 vectors and count many pixels per local-histogram flush; the remaining
+// totalPixels % 8 pixels are counted one at a time.
+void countPixels16(__global const unsigned short* image,
+                   __local int* localHist,
+                   const int totalPixels) {
+    int stride = get_global_size(0);
+    int vectorCount = totalPixels / 8;
+    for (int i = get_global_id(0); i < vectorCount; i += stride) {
+        ushort8 pixels = vload8(i, image);
+        atomic_add(&localHist[binOf(pixels.s0)], 1);
+        atomic_add(&localHist[binOf(pixels.s1)], 1);
+        atomic_add(&localHist[binOf(pixels.s2)], 1);
+        atomic_add(&localHist[binOf(pixels.s3)], 1);
+        atomic_add(&localHist[binOf(pixels.s4)], 1);
+        atomic_add(&localHist[binOf(pixels.s5)], 1);
+        atomic_add(&localHist[binOf(pixels.s6)], 1);
+        atomic_add(&localHist[binOf(pixels.s7)], 1);
+    }
+    for (int i = vectorCount * 8 + get_global_id(0); i < totalPixels; i += stride) {
+        atomic_add(&localHist[binOf(image[i])], 1);
+    }
+}
+
+// Zeroes the copies of a work-group's local histogram
+void clearLocalHistogram16(__local int* localHist, const int replicas) {
+    for (int i = get_local_id(0); i < LOCAL_BINS * replicas; i += get_local_size(0)) {
+        localHist[i] = 0;
+    }
+}
+
+// The copy this work-item counts into
+__local int* localReplica16(__local int* localHist, const int replicas) {
+    return localHist + (get_local_id(0) % replicas) * LOCAL_BINS;
+}
+
+// Adds the summed copies of a work-group's local histogram to a global histogram row
+void flushLocalHistogram16(__local int* localHist, const int replicas, __global count_t* histogram) {
+    for (int i = get_local_id(0); i < LOCAL_BINS; i += get_local_size(0)) {
+        int count = 0;
+        for (int r = 0; r < replicas; r++) {
+            count += localHist[r * LOCAL_BINS + i];
+        }
+        if (count > 0) {
+            addCount(&histogram[i], count);
+        }
+    }
+}
+
 // Kernel to calculate histogram for 16-bit images using local memory
 __kernel void calculateHistogram16(__global const unsigned short* image,
-                                   __global int* histogram,
-                                   const int totalPixels,
-                                   const int numBins,
-                                   const int maxValue) {
-    __local int localHist[256]; // Local memory for work-group histogram (size limited for simplicity)
+                                   __global count_t* histogram,
+                                   const int totalPixels) {
+    __local int localHist[256 * HIST_REPLICAS]; // Local memory for work-group histograms (size limited for simplicity)
+    int channel = get_global_id(1);
+    image += (size_t)channel * totalPixels;
+    histogram += channel * NUM_BINS;
+
+    // Initialize local histograms (only launched for NUM_BINS <= 256; wider histograms use calculateHistogram16Private)
+    clearLocalHistogram16(localHist, HIST_REPLICAS);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Compute local histogram
+    countPixels16(image, localReplica16(localHist, HIST_REPLICAS), totalPixels);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Reduce local histograms to global histogram
+    flushLocalHistogram16(localHist, HIST_REPLICAS, histogram);
+}
+
+// Builds full-range (up to 65536-bin) histograms without local memory limits.
+// Each work-group owns a private NUM_BINS-wide slice of partialHistograms and
+// walks the image with a grid stride (eight pixels per ushort8 load), so groups
+// never contend on the same counters. The host zeroes partialHistograms; counts
+// accumulate across launches, so an image can be counted strip by strip.
+__kernel void calculateHistogram16Private(__global const unsigned short* image,
+                                          __global int* partialHistograms,
+                                          const int totalPixels) {
+    int channel = get_global_id(1);
+    image += (size_t)channel * totalPixels;
+    __global int* groupHist = partialHistograms + ((size_t)channel * get_num_groups(0) + get_group_id(0)) * NUM_BINS;
+
+    int stride = get_global_size(0);
+    int vectorCount = totalPixels / 8;
+    for (int i = get_global_id(0); i < vectorCount; i += stride) {
+        ushort8 pixels = vload8(i, image);
+        atomic_add(&groupHist[binOf(pixels.s0)], 1);
+        atomic_add(&groupHist[binOf(pixels.s1)], 1);
+        atomic_add(&groupHist[binOf(pixels.s2)], 1);
+        atomic_add(&groupHist[binOf(pixels.s3)], 1);
+        atomic_add(&groupHist[binOf(pixels.s4)], 1);
+        atomic_add(&groupHist[binOf(pixels.s5)], 1);
+        atomic_add(&groupHist[binOf(pixels.s6)], 1);
+        atomic_add(&groupHist[binOf(pixels.s7)], 1);
+    }
+    for (int i = vectorCount * 8 + get_global_id(0); i < totalPixels; i += stride) {
+        atomic_add(&groupHist[binOf(image[i])], 1);
+    }
+}
+
+// Merges the per-work-group sub-histograms (one work-item per bin) and adds them to
+// histogram, which the host clears once per image so that strips accumulate
+__kernel void reduceHistogram16(__global const int* partialHistograms,
+                                __global count_t* histogram,
+                                const int numPartials) {
     int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    partialHistograms += (size_t)channel * numPartials * NUM_BINS;
+    histogram += channel * NUM_BINS;
+    if (gid < NUM_BINS) {
+        count_t sum = 0;
+        for (int g = 0; g < numPartials; g++) {
+            sum += partialHistograms[(size_t)g * NUM_BINS + gid];
+        }
+        histogram[gid] += sum;
+    }
+}
+
+// Scans a finished histogram into its exclusive cumulative histogram and
+// normalized LUT (same mapping as normalizeLUT16). Called by a single work-group;
+// temp needs one entry per work-item.
+void buildLUT16(__global count_t* histogram,
+                __global count_t* cumulativeHistogram,
+                __global int* lut,
+                __local count_t* temp,
+                const int totalPixels) {
     int lid = get_local_id(0);
     int groupSize = get_local_size(0);
+    count_t carry = 0;
 
-    // Initialize local histogram (assuming numBins <= 256 for simplicity; adjust for larger bins)
-    for (int i = lid; i < numBins; i += groupSize) {
-        localHist[i] = 0;
+    for (int base = 0; base < NUM_BINS; base += groupSize) {
+        int i = base + lid;
+        count_t value = (i < NUM_BINS) ? ((volatile __global count_t*)histogram)[i] : 0;
+        temp[lid] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < groupSize; offset *= 2) {
+            count_t val = (lid >= offset) ? temp[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            temp[lid] += val;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (i < NUM_BINS) {
+            count_t cumulative = carry + temp[lid] - value;
+            cumulativeHistogram[i] = cumulative;
+            lut[i] = lutValue(cumulative, totalPixels);
+        }
+        carry += temp[groupSize - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Fast-path histogram for up to 256 bins: the last work-group to finish also
+// scans the histogram and writes the LUT. groupsDone must be zero before the
+// first launch; the last work-group resets it for the next one.
+__kernel void calculateHistogramFused16(__global const unsigned short* image,
+                                        __global count_t* histogram,
+                                        __global count_t* cumulativeHistogram,
+                                        __global int* lut,
+                                        __global int* groupsDone,
+                                        const int totalPixels) {
+    __local int localHist[256];
+    __local count_t scanTemp[256];
+    __local int isLastGroup;
+    int lid = get_local_id(0);
+    int channel = get_global_id(1);
+    image += (size_t)channel * totalPixels;
+    histogram += channel * NUM_BINS;
+    cumulativeHistogram += channel * NUM_BINS;
+    lut += channel * NUM_BINS;
+    groupsDone += channel;
+
+    clearLocalHistogram16(localHist, 1);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    countPixels16(image, localReplica16(localHist, 1), totalPixels);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalHistogram16(localHist, 1, histogram);
+
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
+    if (lid == 0) {
+        isLastGroup = (atomic_inc(groupsDone) == (int)get_num_groups(0) - 1);
     }
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    // Compute local histogram
-    if (gid < totalPixels) {
-        unsigned short pixelValue = image[gid];
-        int bin = (int)(((float)pixelValue * numBins) / (maxValue + 1));
-        if (bin < 256) { // Guard for larger numBins
-            atomic_add(&localHist[bin], 1);
-        } else {
-            atomic_add(&histogram[bin], 1); // Fallback to global for bins > 256
+    if (isLastGroup) {
+        buildLUT16(histogram, cumulativeHistogram, lut, scanTemp, totalPixels);
+        if (lid == 0) {
+            *groupsDone = 0;
         }
     }
+}
+
+// Fast-path counterpart of reduceHistogram16 for the full-range histogram: the
+// last work-group to finish merging scans the result and writes the LUT
+__kernel void reduceHistogramFused16(__global const int* partialHistograms,
+                                     __global count_t* histogram,
+                                     __global count_t* cumulativeHistogram,
+                                     __global int* lut,
+                                     __global int* groupsDone,
+                                     const int numPartials,
+                                     const int totalPixels) {
+    __local count_t temp[256];
+    __local int isLastGroup;
+    int gid = get_global_id(0);
+    int lid = get_local_id(0);
+    int channel = get_global_id(1);
+    partialHistograms += (size_t)channel * numPartials * NUM_BINS;
+    histogram += channel * NUM_BINS;
+    cumulativeHistogram += channel * NUM_BINS;
+    lut += channel * NUM_BINS;
+    groupsDone += channel;
+
+    if (gid < NUM_BINS) {
+        count_t sum = 0;
+        for (int g = 0; g < numPartials; g++) {
+            sum += partialHistograms[(size_t)g * NUM_BINS + gid];
+        }
+        publishCount(&histogram[gid], sum);
+    }
+
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
+    if (lid == 0) {
+        isLastGroup = (atomic_inc(groupsDone) == (int)get_num_groups(0) - 1);
+    }
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    // Reduce local histogram to global histogram
-    for (int i = lid; i < numBins && i < 256; i += groupSize) {
-        if (localHist[i] > 0) {
-            atomic_add(&histogram[i], localHist[i]);
+    if (isLastGroup) {
+        buildLUT16(histogram, cumulativeHistogram, lut, temp, totalPixels);
+        if (lid == 0) {
+            *groupsDone = 0;
         }
     }
 }
 
-// Blelloch prefix sum for 16-bit cumulative histogram
-__kernel void prefixSum16(__global int* input,
-                          __global int* output,
+// Blelloch prefix sum for 16-bit cumulative histogram (exclusive scan).
+// Scans one power-of-two block per work-group; the block totals go to blockSums
+// so scanBlockSums16 + addBlockOffsets16 can cover up to 65536 bins.
+__kernel void prefixSum16(__global count_t* input,
+                          __global count_t* output,
+                          __global count_t* blockSums,
                           const int n) {
-    __local int temp[256];
+    __local count_t temp[256];
     int gid = get_global_id(0);
     int lid = get_local_id(0);
+    int blockSize = get_local_size(0);
+    int channel = get_global_id(1);
+    input += channel * n;
+    output += channel * n;
+    blockSums += channel * get_num_groups(0);
 
-    if (gid < n) {
-        temp[lid] = input[gid];
-    }
+    temp[lid] = (gid < n) ? input[gid] : 0;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int d = 1; d < n && d < 256; d *= 2) {
+    for (int d = 1; d < blockSize; d *= 2) {
         int index = 2 * d * (lid + 1) - 1;
-        if (index < n && index < 256) {
+        if (index < blockSize) {
             temp[index] += temp[index - d];
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    if (lid == 0 && n <= 256) {
-        temp[n - 1] = 0;
+    if (lid == 0) {
+        blockSums[get_group_id(0)] = temp[blockSize - 1];
+        temp[blockSize - 1] = 0;
     }
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int d = n / 2; d > 0 && d < 256; d /= 2) {
+    for (int d = blockSize / 2; d > 0; d /= 2) {
         int index = 2 * d * (lid + 1) - 1;
-        if (index < n && index < 256) {
-            int t = temp[index];
+        if (index < blockSize) {
+            count_t t = temp[index];
             temp[index] += temp[index - d];
             temp[index - d] = t;
         }
@@ -76,59 +359,528 @@ __kernel void prefixSum16(__global int* input,
     }
 }
 
-// Hillis-Steele scan for 16-bit cumulative histogram
-__kernel void hillisSteeleScan16(__global int* input,
-                                 __global int* output,
+// Hillis-Steele scan for 16-bit cumulative histogram (inclusive scan)
+__kernel void hillisSteeleScan16(__global count_t* input,
+                                 __global count_t* output,
+                                 __global count_t* blockSums,
                                  const int n) {
-    __local int temp[256];
+    __local count_t temp[256];
     int gid = get_global_id(0);
     int lid = get_local_id(0);
+    int blockSize = get_local_size(0);
+    int channel = get_global_id(1);
+    input += channel * n;
+    output += channel * n;
+    blockSums += channel * get_num_groups(0);
 
-    if (gid < n) {
-        temp[lid] = input[gid];
-    }
+    temp[lid] = (gid < n) ? input[gid] : 0;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int offset = 1; offset < n && offset < 256; offset *= 2) {
-        int val = 0;
+    for (int offset = 1; offset < blockSize; offset *= 2) {
+        count_t val = 0;
         if (lid >= offset) {
             val = temp[lid - offset];
         }
         barrier(CLK_LOCAL_MEM_FENCE);
-        if (gid < n) {
+        temp[lid] += val;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == blockSize - 1) {
+        blockSums[get_group_id(0)] = temp[lid];
+    }
+
+    if (gid < n) {
+        output[gid] = temp[lid];
+    }
+}
+
+// Exclusive scan of the per-block totals in place (single work-group, chunked with a carry)
+__kernel void scanBlockSums16(__global count_t* blockSums,
+                              const int numBlocks) {
+    __local count_t temp[256];
+    __local count_t carry;
+    int lid = get_local_id(0);
+    int blockSize = get_local_size(0);
+    blockSums += get_group_id(1) * numBlocks;
+
+    if (lid == 0) {
+        carry = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int base = 0; base < numBlocks; base += blockSize) {
+        int i = base + lid;
+        count_t value = (i < numBlocks) ? blockSums[i] : 0;
+        temp[lid] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < blockSize; offset *= 2) {
+            count_t val = (lid >= offset) ? temp[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
             temp[lid] += val;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (i < numBlocks) {
+            blockSums[i] = carry + temp[lid] - value;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid == blockSize - 1) {
+            carry += temp[lid];
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
+}
 
+// Adds each block's scanned offset to its elements
+__kernel void addBlockOffsets16(__global count_t* output,
+                                __global const count_t* blockOffsets,
+                                const int n) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    output += channel * n;
+    blockOffsets += channel * get_num_groups(0);
     if (gid < n) {
-        output[gid] = temp[lid];
+        output[gid] += blockOffsets[get_group_id(0)];
     }
 }
 
 // Normalizes cumulative histogram to create LUT for 16-bit
-__kernel void normalizeLUT16(__global int* cumulativeHistogram,
+__kernel void normalizeLUT16(__global count_t* cumulativeHistogram,
                              __global int* lut,
-                             const int totalPixels,
-                             const int numBins,
-                             const int maxValue) {
+                             const count_t totalPixels) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    cumulativeHistogram += channel * NUM_BINS;
+    lut += channel * NUM_BINS;
+    if (gid < NUM_BINS) {
+        lut[gid] = lutValue(cumulativeHistogram[gid], totalPixels);
+    }
+}
+
+// Histogram matching. A cumulative fraction is the share of pixels at or below a bin as a
+// fixed-point number with 32 fraction bits (CDF_ONE = all pixels). Wide counts are shifted
+// down until the total fits 32 bits, which keeps the ratio to within 2^-32.
+#define CDF_ONE 4294967296UL
+
+ulong cdfFraction16(count_t inclusive, count_t totalPixels) {
+    ulong n = inclusive, total = totalPixels;
+    while (total >= CDF_ONE) {
+        n >>= 1;
+        total >>= 1;
+    }
+    return (total > 0) ? (n << 32) / total : 0;
+}
+
+// Maps each bin to the first target bin whose cumulative fraction reaches the bin's own
+// (inverse-CDF lookup by binary search), written as the lowest pixel value of that bin.
+// targetCDF holds one NUM_BINS row of inclusive cumulative fractions per channel, prepared
+// by the host. Same launch as normalizeLUT16: one work-item per bin and channel.
+__kernel void matchLUT16(__global count_t* cumulativeHistogram,
+                         __global int* lut,
+                         const count_t totalPixels,
+                         __global const count_t* histogram,
+                         __global const ulong* targetCDF) {
     int gid = get_global_id(0);
-    if (gid < numBins) {
-        lut[gid] = (totalPixels > 0) ? (int)((float)cumulativeHistogram[gid] / totalPixels * maxValue) : 0;
+    int channel = get_global_id(1);
+    cumulativeHistogram += channel * NUM_BINS;
+    histogram += channel * NUM_BINS;
+    targetCDF += channel * NUM_BINS;
+    lut += channel * NUM_BINS;
+    if (gid < NUM_BINS) {
+        ulong level = cdfFraction16(cumulativeHistogram[gid] + histogram[gid], totalPixels);
+        int lo = 0, hi = NUM_BINS - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (targetCDF[mid] >= level) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        lut[gid] = (int)(((ulong)lo * (MAX_VALUE + 1)) / NUM_BINS);
     }
 }
 
-// Applies LUT to equalize 16-bit image
+// Temporal (video) mode. running is an exponentially decayed histogram of the past frames,
+// into which every frame's histogram is blended with weight alpha / 256; reference is the
+// running histogram the current LUT was built from. One work-group per channel.
+
+// Sum of value over the work-group (at most 256 work-items)
+float groupSum16(__local float* partial, float value) {
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    partial[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = 1; offset < groupSize; offset *= 2) {
+        if (lid % (2 * offset) == 0 && lid + offset < groupSize) {
+            partial[lid] += partial[lid + offset];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    float sum = partial[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return sum;
+}
+
+// Blends the frame's histogram into running and copies the result back into histogram, so
+// the unchanged scan and normalizeLUT16 build the LUT from the running histogram. Writes the
+// total variation distance between the running and reference distributions to drift (0 =
+// identical, 1 = disjoint); the host rebuilds the LUT once it passes a threshold.
+__kernel void decayHistogram16(__global count_t* histogram,
+                               __global count_t* running,
+                               __global const count_t* reference,
+                               __global float* drift,
+                               const int alpha) {
+    __local float partial[256];
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    int channel = get_global_id(1);
+    histogram += channel * NUM_BINS;
+    running += channel * NUM_BINS;
+    reference += channel * NUM_BINS;
+
+    float runningTotal = 0.0f, referenceTotal = 0.0f;
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        count_t blended = (count_t)(((ulong)running[i] * (256 - alpha) + (ulong)histogram[i] * alpha + 128) >> 8);
+        running[i] = blended;
+        histogram[i] = blended;
+        runningTotal += blended;
+        referenceTotal += reference[i];
+    }
+    runningTotal = groupSum16(partial, runningTotal);
+    referenceTotal = groupSum16(partial, referenceTotal);
+
+    float distance = 0.0f;
+    if (runningTotal > 0.0f && referenceTotal > 0.0f) {
+        for (int i = lid; i < NUM_BINS; i += groupSize) {
+            distance += fabs(running[i] / runningTotal - reference[i] / referenceTotal);
+        }
+    }
+    distance = groupSum16(partial, distance);
+    if (lid == 0) {
+        drift[channel] = (runningTotal > 0.0f && referenceTotal > 0.0f) ? 0.5f * distance : 1.0f;
+    }
+}
+
+// Applies LUT to equalize 16-bit image; work-items walk the plane with a grid stride, so the
+// host can choose how many pixels each one maps
 __kernel void applyLUT16(__global const unsigned short* inputImage,
                          __global const int* lut,
                          __global unsigned short* outputImage,
-                         const int totalPixels,
-                         const int numBins) {
+                         const int totalPixels) {
+    int channel = get_global_id(1);
+    inputImage += (size_t)channel * totalPixels;
+    outputImage += (size_t)channel * totalPixels;
+    lut += channel * NUM_BINS;
+    for (int i = get_global_id(0); i < totalPixels; i += get_global_size(0)) {
+        unsigned short pixelValue = inputImage[i];
+        outputImage[i] = (unsigned short)lut[binOf(pixelValue)];
+    }
+}
+
+// Luma mode for RGB images (three planes): one histogram of the BT.601 luma
+// Y = 0.299 R + 0.587 G + 0.114 B, computed on the fly, and one LUT applied to it. Adding
+// Y' - Y to all three channels keeps the chroma differences B - Y and R - Y (Cb, Cr), so
+// colours keep their hue. Histograms and LUTs are a single NUM_BINS row; NDRanges use only
+// dimension 0, with the launch shapes of the per-channel histogram and apply kernels.
+
+// Integer BT.601 luma (weights scaled by 65536 and summing to 65536, so no overflow)
+uint lumaOf16(uint r, uint g, uint b) {
+    return (r * 19595u + g * 38470u + b * 7471u + 32768u) >> 16;
+}
+
+// Luma of eight pixels at once, from one ushort8 vector of each plane
+uint8 lumaOfVector16(__global const unsigned short* image, const int totalPixels, int v) {
+    uint8 r = convert_uint8(vload8(v, image));
+    uint8 g = convert_uint8(vload8(v, image + totalPixels));
+    uint8 b = convert_uint8(vload8(v, image + 2 * (size_t)totalPixels));
+    return (r * 19595u + g * 38470u + b * 7471u + 32768u) >> 16;
+}
+
+uint lumaAt16(__global const unsigned short* image, const int totalPixels, int i) {
+    return lumaOf16(image[i], image[(size_t)totalPixels + i], image[2 * (size_t)totalPixels + i]);
+}
+
+// Counts like calculateHistogram16: the grid strides over ushort8 vectors of the three planes,
+// with HIST_REPLICAS copies of the local histogram (only launched for NUM_BINS <= 256; wider
+// histograms use calculateLumaHistogram16Private)
+__kernel void calculateLumaHistogram16(__global const unsigned short* image,
+                                       __global count_t* histogram,
+                                       const int totalPixels) {
+    __local int localHist[256 * HIST_REPLICAS];
+    clearLocalHistogram16(localHist, HIST_REPLICAS);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __local int* hist = localReplica16(localHist, HIST_REPLICAS);
+    int stride = get_global_size(0);
+    int vectorCount = totalPixels / 8;
+    for (int i = get_global_id(0); i < vectorCount; i += stride) {
+        uint8 y = lumaOfVector16(image, totalPixels, i);
+        atomic_add(&hist[binOf(y.s0)], 1);
+        atomic_add(&hist[binOf(y.s1)], 1);
+        atomic_add(&hist[binOf(y.s2)], 1);
+        atomic_add(&hist[binOf(y.s3)], 1);
+        atomic_add(&hist[binOf(y.s4)], 1);
+        atomic_add(&hist[binOf(y.s5)], 1);
+        atomic_add(&hist[binOf(y.s6)], 1);
+        atomic_add(&hist[binOf(y.s7)], 1);
+    }
+    for (int i = vectorCount * 8 + get_global_id(0); i < totalPixels; i += stride) {
+        atomic_add(&hist[binOf(lumaAt16(image, totalPixels, i))], 1);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalHistogram16(localHist, HIST_REPLICAS, histogram);
+}
+
+// Luma counterpart of calculateHistogram16Private for wider histograms: each work-group
+// counts into its own NUM_BINS-wide slice of partialHistograms, which reduceHistogram16
+// (or reduceHistogramFused16) merges into the single luma row
+__kernel void calculateLumaHistogram16Private(__global const unsigned short* image,
+                                              __global int* partialHistograms,
+                                              const int totalPixels) {
+    __global int* groupHist = partialHistograms + (size_t)get_group_id(0) * NUM_BINS;
+    int stride = get_global_size(0);
+    int vectorCount = totalPixels / 8;
+    for (int i = get_global_id(0); i < vectorCount; i += stride) {
+        uint8 y = lumaOfVector16(image, totalPixels, i);
+        atomic_add(&groupHist[binOf(y.s0)], 1);
+        atomic_add(&groupHist[binOf(y.s1)], 1);
+        atomic_add(&groupHist[binOf(y.s2)], 1);
+        atomic_add(&groupHist[binOf(y.s3)], 1);
+        atomic_add(&groupHist[binOf(y.s4)], 1);
+        atomic_add(&groupHist[binOf(y.s5)], 1);
+        atomic_add(&groupHist[binOf(y.s6)], 1);
+        atomic_add(&groupHist[binOf(y.s7)], 1);
+    }
+    for (int i = vectorCount * 8 + get_global_id(0); i < totalPixels; i += stride) {
+        atomic_add(&groupHist[binOf(lumaAt16(image, totalPixels, i))], 1);
+    }
+}
+
+// Converts to YCbCr, maps the luma through the LUT and converts back in one pass; like
+// applyLUT16, work-items walk the planes with a grid stride
+__kernel void applyLumaLUT16(__global const unsigned short* inputImage,
+                             __global const int* lut,
+                             __global unsigned short* outputImage,
+                             const int totalPixels) {
+    for (int i = get_global_id(0); i < totalPixels; i += get_global_size(0)) {
+        int r = inputImage[i];
+        int g = inputImage[(size_t)totalPixels + i];
+        int b = inputImage[2 * (size_t)totalPixels + i];
+        int y = lumaOf16(r, g, b);
+        int delta = lut[binOf(y)] - y;
+        outputImage[i] = (unsigned short)clamp(r + delta, 0, MAX_VALUE);
+        outputImage[(size_t)totalPixels + i] = (unsigned short)clamp(g + delta, 0, MAX_VALUE);
+        outputImage[2 * (size_t)totalPixels + i] = (unsigned short)clamp(b + delta, 0, MAX_VALUE);
+    }
+}
+
+
+// CLAHE (contrast-limited adaptive histogram equalization). Each channel plane is split into
+// tiles of tileWidth x tileHeight pixels, numbered row-major (tiles in the last row and column
+// may be smaller). Tile histograms and LUTs are one NUM_BINS-long row per tile, with all tiles
+// of channel 0 first. Every kernel launches one work-group per tile in dimension 0. NUM_BINS
+// must be at most 256 so that a tile histogram fits in local memory.
+
+// Bounds of this work-group's tile
+void tileBounds16(const int width, const int height, const int tileWidth, const int tileHeight,
+                  int* x0, int* y0, int* x1, int* y1) {
+    int tilesX = (width + tileWidth - 1) / tileWidth;
+    int tile = get_group_id(0);
+    *x0 = (tile % tilesX) * tileWidth;
+    *y0 = (tile / tilesX) * tileHeight;
+    *x1 = min(*x0 + tileWidth, width);
+    *y1 = min(*y0 + tileHeight, height);
+}
+
+// Along one axis of extent pixels split into tiles of tileSize (the last one possibly smaller),
+// finds the two tiles whose centres surround pixel p and returns the weight of the second.
+// Centres are the midpoints of the clipped tile bounds, so a short last tile is centred on
+// itself; pixels outside the outermost centres get a single tile and weight 0.
+float tileBlend16(const int p, const int tileSize, const int tiles, const int extent, int* t0, int* t1) {
+    float pos = p + 0.5f;
+    float lastCentre = ((tiles - 1) * tileSize + extent) * 0.5f;
+    int t = (pos >= lastCentre) ? tiles - 1 : (int)floor(pos / tileSize - 0.5f);
+    *t0 = clamp(t, 0, tiles - 1);
+    *t1 = min(t + 1, tiles - 1);
+    if (t < 0 || *t0 == *t1) {
+        return 0.0f;
+    }
+    float c0 = (t + 0.5f) * tileSize;
+    float c1 = (t + 1 == tiles - 1) ? lastCentre : c0 + tileSize;
+    return (pos - c0) / (c1 - c0);
+}
+
+// Counts each tile into a local histogram with the whole work-group and writes its row; no
+// global atomics are needed because every tile belongs to exactly one work-group
+__kernel void calculateTileHistograms16(__global const unsigned short* image,
+                                        __global int* tileHistograms,
+                                        const int width,
+                                        const int height,
+                                        const int tileWidth,
+                                        const int tileHeight) {
+    __local int localHist[256];
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    int channel = get_global_id(1);
+    image += (size_t)channel * width * height;
+    tileHistograms += ((size_t)channel * get_num_groups(0) + get_group_id(0)) * NUM_BINS;
+
+    int x0, y0, x1, y1;
+    tileBounds16(width, height, tileWidth, tileHeight, &x0, &y0, &x1, &y1);
+    int w = x1 - x0;
+    int tilePixels = w * (y1 - y0);
+
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        localHist[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Walk the tile as one flat range so narrow tiles still keep every work-item busy
+    for (int i = lid; i < tilePixels; i += groupSize) {
+        int x = x0 + i % w;
+        int y = y0 + i / w;
+        atomic_add(&localHist[binOf(image[(size_t)y * width + x])], 1);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        tileHistograms[i] = localHist[i];
+    }
+}
+
+// Clips each tile histogram at clipLimit * tilePixels / NUM_BINS counts (clipLimit <= 0
+// disables clipping), spreads the clipped excess evenly over all bins and scans the result
+// into the tile's LUT with the same exclusive mapping as normalizeLUT16, so a single unclipped
+// tile reproduces global equalization
+__kernel void buildTileLUTs16(__global const int* tileHistograms,
+                              __global int* tileLUTs,
+                              const int width,
+                              const int height,
+                              const int tileWidth,
+                              const int tileHeight,
+                              const float clipLimit) {
+    __local int hist[256];
+    __local int temp[256];
+    __local int excess;
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    int channel = get_global_id(1);
+    size_t row = ((size_t)channel * get_num_groups(0) + get_group_id(0)) * NUM_BINS;
+    tileHistograms += row;
+    tileLUTs += row;
+
+    int x0, y0, x1, y1;
+    tileBounds16(width, height, tileWidth, tileHeight, &x0, &y0, &x1, &y1);
+    int tilePixels = (x1 - x0) * (y1 - y0);
+    int limit = (clipLimit > 0.0f) ? max((int)(clipLimit * tilePixels / NUM_BINS), 1) : tilePixels;
+
+    if (lid == 0) {
+        excess = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        int count = tileHistograms[i];
+        if (count > limit) {
+            atomic_add(&excess, count - limit);
+            count = limit;
+        }
+        hist[i] = count;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Every bin gets an equal share; the remainder goes to evenly spaced bins
+    int share = excess / NUM_BINS;
+    int residual = excess % NUM_BINS;
+    int step = (residual > 0) ? NUM_BINS / residual : 1;
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        hist[i] += share + ((residual > 0 && i % step == 0 && i / step < residual) ? 1 : 0);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int carry = 0;
+    for (int base = 0; base < NUM_BINS; base += groupSize) {
+        int i = base + lid;
+        int value = (i < NUM_BINS) ? hist[i] : 0;
+        temp[lid] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < groupSize; offset *= 2) {
+            int val = (lid >= offset) ? temp[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            temp[lid] += val;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (i < NUM_BINS) {
+            int cumulative = carry + temp[lid] - value;
+            tileLUTs[i] = lutValue(cumulative, tilePixels);
+        }
+        carry += temp[groupSize - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Maps every pixel through the LUTs of the four tiles whose centres surround it, blended
+// bilinearly by its distance to those centres; pixels outside the outermost centres use the
+// nearest tiles only
+__kernel void applyCLAHE16(__global const unsigned short* inputImage,
+                           __global const int* tileLUTs,
+                           __global unsigned short* outputImage,
+                           const int width,
+                           const int height,
+                           const int tileWidth,
+                           const int tileHeight) {
     int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    int totalPixels = width * height;
+    if (gid >= totalPixels) {
+        return;
+    }
+    int tilesX = (width + tileWidth - 1) / tileWidth;
+    int tilesY = (height + tileHeight - 1) / tileHeight;
+    inputImage += (size_t)channel * totalPixels;
+    outputImage += (size_t)channel * totalPixels;
+    tileLUTs += (size_t)channel * tilesX * tilesY * NUM_BINS;
+
+    int tx0, tx1, ty0, ty1;
+    float wx = tileBlend16(gid % width, tileWidth, tilesX, width, &tx0, &tx1);
+    float wy = tileBlend16(gid / width, tileHeight, tilesY, height, &ty0, &ty1);
+
+    int bin = binOf(inputImage[gid]);
+    float top = mix((float)tileLUTs[(ty0 * tilesX + tx0) * NUM_BINS + bin], (float)tileLUTs[(ty0 * tilesX + tx1) * NUM_BINS + bin], wx);
+    float bottom = mix((float)tileLUTs[(ty1 * tilesX + tx0) * NUM_BINS + bin], (float)tileLUTs[(ty1 * tilesX + tx1) * NUM_BINS + bin], wx);
+    outputImage[gid] = (unsigned short)(mix(top, bottom, wy) + 0.5f);
+}
+
+// Converts an interleaved 16-bit big-endian PGM/PPM payload (as stored in the file) to the
+// planar layout
+__kernel void unpackPnm16(__global const uchar* packed,
+                          __global unsigned short* image,
+                          const int totalPixels) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    int channels = get_global_size(1);
     if (gid < totalPixels) {
-        unsigned short pixelValue = inputImage[gid];
-        int bin = (int)(((float)pixelValue * numBins) / 65536);
-        outputImage[gid] = (unsigned short)lut[bin];
+        size_t i = ((size_t)gid * channels + channel) * 2;
+        image[(size_t)channel * totalPixels + gid] = (unsigned short)((packed[i] << 8) | packed[i + 1]);
     }
 }
 
+// Converts a planar image back to an interleaved 16-bit big-endian PGM/PPM payload
+__kernel void packPnm16(__global const unsigned short* image,
+                        __global uchar* packed,
+                        const int totalPixels) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    int channels = get_global_size(1);
+    if (gid < totalPixels) {
+        size_t i = ((size_t)gid * channels + channel) * 2;
+        unsigned short pixelValue = image[(size_t)channel * totalPixels + gid];
+        packed[i] = (uchar)(pixelValue >> 8);
+        packed[i + 1] = (uchar)(pixelValue & 0xFF);
+    }
+}
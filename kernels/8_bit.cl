@@ -1,145 +1,829 @@
-__kernel void calculateHistogram(__global const unsigned short* image,
-                                __global int* histogram,
-                                const int totalPixels,
-                                const int numBins,
-                                const int maxValue) {
-    __local int localHist[256];
-    int gid = get_global_id(0);
-    int lid = get_local_id(0);
-    int groupSize = get_local_size(0);
-
-    for (int i = lid; i < numBins; i += groupSize) {
-        localHist[i] = 0;
-    }
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    if (gid < totalPixels) {
-        unsigned short pixelValue = image[gid];
-        int bin = (numBins == 256) ? pixelValue : (pixelValue * numBins) / (maxValue + 1);
-        if (bin < numBins) {
-            atomic_add(&localHist[bin], 1);
-        }
-    }
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    for (int i = lid; i < numBins; i += groupSize) {
-        if (localHist[i] > 0) {
-            atomic_add(&histogram[i], localHist[i]);
-        }
-    }
-}
-// Blelloch prefix sum for cumulative histogram (exclusive scan)
-__kernel void prefixSum(__global int* input,
-                       __global int* output,
-                       const int n) {
-    // Local memory for scan (assumes n <= 256)
-    __local int temp[256];
-    int gid = get_global_id(0);
-    int lid = get_local_id(0);
-
-    // Load input into local memory (shift for exclusive scan)
-    if (gid < n) {
-        temp[lid] = (gid > 0) ? input[gid - 1] : 0;
-    } else {
-        temp[lid] = 0;
-    }
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    // Upsweep phase
-    for (int d = 1; d < n; d *= 2) {
-        int index = (lid + 1) * 2 * d - 1;
-        if (index < n && index < 256) {
-            temp[index] += temp[index - d];
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-    }
-
-    // Downsweep phase
-    if (lid == 0) {
-        temp[n - 1] = 0;
-    }
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    for (int d = n / 2; d > 0; d /= 2) {
-        int index = (lid + 1) * 2 * d - 1;
-        if (index < n && index < 256) {
-            int t = temp[index];
-            temp[index] += temp[index - d];
-            temp[index - d] = t;
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-    }
-
-    // Write result to output
-    if (gid < n) {
-        output[gid] = temp[lid];
-    }
-}
-
-// Hillis-Steele scan for alternative cumulative histogram (exclusive scan)
-__kernel void hillisSteeleScan(__global int* input,
-                               __global int* output,
-                               const int n) {
-    // Local memory for scan (assumes n <= 256)
-    __local int temp[256];
-    int gid = get_global_id(0);
-    int lid = get_local_id(0);
-
-    // Load input into local memory (shift for exclusive scan)
-    if (gid < n) {
-        temp[lid] = (gid > 0) ? input[gid - 1] : 0;
-    } else {
-        temp[lid] = 0;
-    }
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    // Iterative scan
-    for (int offset = 1; offset < n; offset *= 2) {
-        int val = 0;
-        if (lid >= offset) {
-            val = temp[lid - offset];
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (gid < n) {
-            temp[lid] += val;
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-    }
-
-    // Write result to output
-    if (gid < n) {
-        output[gid] = temp[lid];
-    }
-}
-
-// Normalizes cumulative histogram to create LUT
-__kernel void normalizeLUT(__global int* cumulativeHistogram,
-                          __global int* lut,
-                          const int totalPixels,
-                          const int numBins,
-                          const int maxValue) {
-    int gid = get_global_id(0);
-    if (gid < numBins) {
-        // Use integer arithmetic to avoid floating-point issues
-        lut[gid] = (totalPixels > 0) ? (cumulativeHistogram[gid] * maxValue) / totalPixels : 0;
-        // Clamp to [0, maxValue] for safety
-        lut[gid] = min(max(lut[gid], 0), maxValue);
-    }
-}
-
-__kernel void applyLUT(__global const unsigned short* inputImage,
-                      __global const int* lut,
-                      __global unsigned short* outputImage,
-                      const int totalPixels,
-                      const int numBins) {
-    int gid = get_global_id(0);
-    if (gid < totalPixels) {
-        unsigned short pixelValue = inputImage[gid];
-        int bin = (numBins == 256) ? pixelValue : (pixelValue * numBins) / 256;
-        if (bin < numBins) {
-            outputImage[gid] = (unsigned short)lut[bin];
-        } else {
-            outputImage[gid] = 0; // Fallback
-        }
-    }
-}
+// Multi-channel images are stored planar (one totalPixels-long plane per channel, as in
+// CImg) and every NDRange uses dimension 1 to select the channel, so each stage processes
+// all channels in a single launch. Histograms, cumulative histograms and LUTs are laid out
+// as one NUM_BINS-long row per channel. Pixels are stored as uchar, one byte per sample.
+
+// Bin count, maximum pixel value and binning shift are compile-time constants supplied by
+// the host as -DNUM_BINS=... -DMAX_VALUE=... -DSHIFT=...; SHIFT is log2((MAX_VALUE + 1) / NUM_BINS)
+// when that ratio is a power of two and -1 otherwise, so binning is a single shift whenever possible.
+#ifndef NUM_BINS
+#define NUM_BINS 256
+#endif
+#ifndef MAX_VALUE
+#define MAX_VALUE 255
+#endif
+#ifndef SHIFT
+#define SHIFT 0
+#endif
+
+// Copies of the local histogram per work-group, supplied as -DHIST_REPLICAS=... (chosen by the
+// autotuner). Work-item i counts into copy i % HIST_REPLICAS, which spreads the atomics of a
+// busy bin over several addresses; the copies are summed when the group flushes its counts.
+// Only the separate histogram kernels use them: the fused kernels, which the autotuner does
+// not time, keep a single copy next to their scan array.
+#ifndef HIST_REPLICAS
+#define HIST_REPLICAS 1
+#endif
+
+// Histogram, cumulative histogram and scan counts are 32-bit ints unless the host defines
+// WIDE_COUNTS for images with more than INT_MAX pixels per channel. Work-group local
+// histograms stay 32-bit either way and are flushed into the global counts by addCount.
+#ifdef WIDE_COUNTS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+typedef ulong count_t;
+#else
+typedef int count_t;
+#endif
+
+// Adds a work-group's local count to a global histogram bin
+void addCount(__global count_t* bin, int count) {
+#ifdef WIDE_COUNTS
+    atom_add(bin, (ulong)count);
+#else
+    atomic_add(bin, count);
+#endif
+}
+
+// Maps an exclusive cumulative count to its equalized value. The product is taken in 64 bits,
+// so cumulative * MAX_VALUE cannot overflow however large the image is.
+int lutValue(count_t cumulative, count_t totalPixels) {
+    return (totalPixels > 0) ? (int)min((ulong)cumulative * MAX_VALUE / (ulong)totalPixels, (ulong)MAX_VALUE) : 0;
+}
+
+// Maps a pixel value to its histogram bin
+int binOf(uint pixelValue) {
+#if SHIFT >= 0
+    return pixelValue >> SHIFT;
+#else
+    return (pixelValue * NUM_BINS) / (MAX_VALUE + 1);
+#endif
+}
+
+// Counts this work-item's share of an image plane into localHist. The NDRange is sized from
+// the device's compute units rather than the image, so work-items walk the plane with a grid
+// stride over uchar16 vectors and count many pixels per local-histogram flush; the remaining
+// totalPixels % 16 pixels are counted one at a time.
+void countPixels(__global const uchar* image,
+                 __local int* localHist,
+                 const int totalPixels) {
+    int stride = get_global_size(0);
+    int vectorCount = totalPixels / 16;
+    for (int i = get_global_id(0); i < vectorCount; i += stride) {
+        uchar16 pixels = vload16(i, image);
+        atomic_add(&localHist[binOf(pixels.s0)], 1);
+        atomic_add(&localHist[binOf(pixels.s1)], 1);
+        atomic_add(&localHist[binOf(pixels.s2)], 1);
+        atomic_add(&localHist[binOf(pixels.s3)], 1);
+        atomic_add(&localHist[binOf(pixels.s4)], 1);
+        atomic_add(&localHist[binOf(pixels.s5)], 1);
+        atomic_add(&localHist[binOf(pixels.s6)], 1);
+        atomic_add(&localHist[binOf(pixels.s7)], 1);
+        atomic_add(&localHist[binOf(pixels.s8)], 1);
+        atomic_add(&localHist[binOf(pixels.s9)], 1);
+        atomic_add(&localHist[binOf(pixels.sa)], 1);
+        atomic_add(&localHist[binOf(pixels.sb)], 1);
+        atomic_add(&localHist[binOf(pixels.sc)], 1);
+        atomic_add(&localHist[binOf(pixels.sd)], 1);
+        atomic_add(&localHist[binOf(pixels.se)], 1);
+        atomic_add(&localHist[binOf(pixels.sf)], 1);
+    }
+    for (int i = vectorCount * 16 + get_global_id(0); i < totalPixels; i += stride) {
+        atomic_add(&localHist[binOf(image[i])], 1);
+    }
+}
+
+// Zeroes the copies of a work-group's local histogram
+void clearLocalHistogram(__local int* localHist, const int replicas) {
+    for (int i = get_local_id(0); i < NUM_BINS * replicas; i += get_local_size(0)) {
+        localHist[i] = 0;
+    }
+}
+
+// The copy this work-item counts into
+__local int* localReplica(__local int* localHist, const int replicas) {
+    return localHist + (get_local_id(0) % replicas) * NUM_BINS;
+}
+
+// Adds the summed copies of a work-group's local histogram to a global histogram row
+void flushLocalHistogram(__local int* localHist, const int replicas, __global count_t* histogram) {
+    for (int i = get_local_id(0); i < NUM_BINS; i += get_local_size(0)) {
+        int count = 0;
+        for (int r = 0; r < replicas; r++) {
+            count += localHist[r * NUM_BINS + i];
+        }
+        if (count > 0) {
+            addCount(&histogram[i], count);
+        }
+    }
+}
+
+__kernel void calculateHistogram(__global const uchar* image,
+                                __global count_t* histogram,
+                                const int totalPixels) {
+    __local int localHist[256 * HIST_REPLICAS];
+    int channel = get_global_id(1);
+    image += (size_t)channel * totalPixels;
+    histogram += channel * NUM_BINS;
+
+    clearLocalHistogram(localHist, HIST_REPLICAS);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    countPixels(image, localReplica(localHist, HIST_REPLICAS), totalPixels);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalHistogram(localHist, HIST_REPLICAS, histogram);
+}
+// Scans a finished histogram into its exclusive cumulative histogram and
+// normalized LUT (same mapping as normalizeLUT). Called by a single work-group;
+// temp needs one entry per work-item.
+void buildLUT(__global count_t* histogram,
+              __global count_t* cumulativeHistogram,
+              __global int* lut,
+              __local count_t* temp,
+              const int totalPixels) {
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    count_t carry = 0;
+
+    for (int base = 0; base < NUM_BINS; base += groupSize) {
+        int i = base + lid;
+        count_t value = (i < NUM_BINS) ? ((volatile __global count_t*)histogram)[i] : 0;
+        temp[lid] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < groupSize; offset *= 2) {
+            count_t val = (lid >= offset) ? temp[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            temp[lid] += val;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (i < NUM_BINS) {
+            count_t cumulative = carry + temp[lid] - value;
+            cumulativeHistogram[i] = cumulative;
+            lut[i] = lutValue(cumulative, totalPixels);
+        }
+        carry += temp[groupSize - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Fast-path histogram: same local privatization as calculateHistogram, but the
+// last work-group to finish also scans the histogram and writes the LUT, replacing
+// the separate scan and normalizeLUT launches. groupsDone must be zero before the
+// first launch; the last work-group resets it for the next one.
+__kernel void calculateHistogramFused(__global const uchar* image,
+                                      __global count_t* histogram,
+                                      __global count_t* cumulativeHistogram,
+                                      __global int* lut,
+                                      __global int* groupsDone,
+                                      const int totalPixels) {
+    __local int localHist[256];
+    __local count_t scanTemp[256];
+    __local int isLastGroup;
+    int lid = get_local_id(0);
+    int channel = get_global_id(1);
+    image += (size_t)channel * totalPixels;
+    histogram += channel * NUM_BINS;
+    cumulativeHistogram += channel * NUM_BINS;
+    lut += channel * NUM_BINS;
+    groupsDone += channel;
+
+    clearLocalHistogram(localHist, 1);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    countPixels(image, localReplica(localHist, 1), totalPixels);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalHistogram(localHist, 1, histogram);
+
+    // Make this group's contributions visible before counting it as done
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
+    if (lid == 0) {
+        isLastGroup = (atomic_inc(groupsDone) == (int)get_num_groups(0) - 1);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (isLastGroup) {
+        buildLUT(histogram, cumulativeHistogram, lut, scanTemp, totalPixels);
+        if (lid == 0) {
+            *groupsDone = 0;
+        }
+    }
+}
+
+// Blelloch prefix sum for cumulative histogram (exclusive scan).
+// Each work-group scans one power-of-two block and stores the block total in
+// blockSums; scanBlockSums + addBlockOffsets stitch the blocks together when n
+// exceeds the work-group size.
+__kernel void prefixSum(__global count_t* input,
+                       __global count_t* output,
+                       __global count_t* blockSums,
+                       const int n) {
+    __local count_t temp[256];
+    int gid = get_global_id(0);
+    int lid = get_local_id(0);
+    int blockSize = get_local_size(0);
+    int channel = get_global_id(1);
+    input += channel * n;
+    output += channel * n;
+    blockSums += channel * get_num_groups(0);
+
+    temp[lid] = (gid < n) ? input[gid] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Upsweep phase
+    for (int d = 1; d < blockSize; d *= 2) {
+        int index = (lid + 1) * 2 * d - 1;
+        if (index < blockSize) {
+            temp[index] += temp[index - d];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Record the block total, then clear the root for the downsweep
+    if (lid == 0) {
+        blockSums[get_group_id(0)] = temp[blockSize - 1];
+        temp[blockSize - 1] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Downsweep phase
+    for (int d = blockSize / 2; d > 0; d /= 2) {
+        int index = (lid + 1) * 2 * d - 1;
+        if (index < blockSize) {
+            count_t t = temp[index];
+            temp[index] += temp[index - d];
+            temp[index - d] = t;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Write result to output
+    if (gid < n) {
+        output[gid] = temp[lid];
+    }
+}
+
+// Hillis-Steele scan for alternative cumulative histogram (exclusive scan).
+// Same block decomposition as prefixSum.
+__kernel void hillisSteeleScan(__global count_t* input,
+                               __global count_t* output,
+                               __global count_t* blockSums,
+                               const int n) {
+    __local count_t temp[256];
+    int gid = get_global_id(0);
+    int lid = get_local_id(0);
+    int blockSize = get_local_size(0);
+    int channel = get_global_id(1);
+    input += channel * n;
+    output += channel * n;
+    blockSums += channel * get_num_groups(0);
+
+    // Load input into local memory (shift for exclusive scan)
+    temp[lid] = (gid > 0 && gid < n) ? input[gid - 1] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Iterative scan
+    for (int offset = 1; offset < blockSize; offset *= 2) {
+        count_t val = 0;
+        if (lid >= offset) {
+            val = temp[lid - offset];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        temp[lid] += val;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == blockSize - 1) {
+        blockSums[get_group_id(0)] = temp[lid];
+    }
+
+    // Write result to output
+    if (gid < n) {
+        output[gid] = temp[lid];
+    }
+}
+
+// Exclusive scan of the per-block totals in place, run by a single work-group
+// that walks numBlocks in chunks of its own size and carries the running total
+__kernel void scanBlockSums(__global count_t* blockSums,
+                            const int numBlocks) {
+    __local count_t temp[256];
+    __local count_t carry;
+    int lid = get_local_id(0);
+    int blockSize = get_local_size(0);
+    blockSums += get_group_id(1) * numBlocks;
+
+    if (lid == 0) {
+        carry = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int base = 0; base < numBlocks; base += blockSize) {
+        int i = base + lid;
+        count_t value = (i < numBlocks) ? blockSums[i] : 0;
+        temp[lid] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < blockSize; offset *= 2) {
+            count_t val = (lid >= offset) ? temp[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            temp[lid] += val;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (i < numBlocks) {
+            blockSums[i] = carry + temp[lid] - value;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid == blockSize - 1) {
+            carry += temp[lid];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Adds each block's scanned offset to its elements (same work-group size as the block scan)
+__kernel void addBlockOffsets(__global count_t* output,
+                              __global const count_t* blockOffsets,
+                              const int n) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    output += channel * n;
+    blockOffsets += channel * get_num_groups(0);
+    if (gid < n) {
+        output[gid] += blockOffsets[get_group_id(0)];
+    }
+}
+
+// Normalizes cumulative histogram to create LUT
+__kernel void normalizeLUT(__global count_t* cumulativeHistogram,
+                          __global int* lut,
+                          const count_t totalPixels) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    cumulativeHistogram += channel * NUM_BINS;
+    lut += channel * NUM_BINS;
+    if (gid < NUM_BINS) {
+        // Integer arithmetic, exact for any image size
+        lut[gid] = lutValue(cumulativeHistogram[gid], totalPixels);
+    }
+}
+
+// Histogram matching. A cumulative fraction is the share of pixels at or below a bin as a
+// fixed-point number with 32 fraction bits (CDF_ONE = all pixels). Wide counts are shifted
+// down until the total fits 32 bits, which keeps the ratio to within 2^-32.
+#define CDF_ONE 4294967296UL
+
+ulong cdfFraction(count_t inclusive, count_t totalPixels) {
+    ulong n = inclusive, total = totalPixels;
+    while (total >= CDF_ONE) {
+        n >>= 1;
+        total >>= 1;
+    }
+    return (total > 0) ? (n << 32) / total : 0;
+}
+
+// Maps each bin to the first target bin whose cumulative fraction reaches the bin's own
+// (inverse-CDF lookup by binary search), written as the lowest pixel value of that bin.
+// targetCDF holds one NUM_BINS row of inclusive cumulative fractions per channel, prepared
+// by the host. Same launch as normalizeLUT: one work-item per bin and channel.
+__kernel void matchLUT(__global count_t* cumulativeHistogram,
+                       __global int* lut,
+                       const count_t totalPixels,
+                       __global const count_t* histogram,
+                       __global const ulong* targetCDF) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    cumulativeHistogram += channel * NUM_BINS;
+    histogram += channel * NUM_BINS;
+    targetCDF += channel * NUM_BINS;
+    lut += channel * NUM_BINS;
+    if (gid < NUM_BINS) {
+        ulong level = cdfFraction(cumulativeHistogram[gid] + histogram[gid], totalPixels);
+        int lo = 0, hi = NUM_BINS - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (targetCDF[mid] >= level) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        lut[gid] = (int)(((ulong)lo * (MAX_VALUE + 1)) / NUM_BINS);
+    }
+}
+
+// Temporal (video) mode. running is an exponentially decayed histogram of the past frames,
+// into which every frame's histogram is blended with weight alpha / 256; reference is the
+// running histogram the current LUT was built from. One work-group per channel.
+
+// Sum of value over the work-group (at most 256 work-items)
+float groupSum(__local float* partial, float value) {
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    partial[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = 1; offset < groupSize; offset *= 2) {
+        if (lid % (2 * offset) == 0 && lid + offset < groupSize) {
+            partial[lid] += partial[lid + offset];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    float sum = partial[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return sum;
+}
+
+// Blends the frame's histogram into running and copies the result back into histogram, so
+// the unchanged scan and normalizeLUT build the LUT from the running histogram. Writes the
+// total variation distance between the running and reference distributions to drift (0 =
+// identical, 1 = disjoint); the host rebuilds the LUT once it passes a threshold.
+__kernel void decayHistogram(__global count_t* histogram,
+                             __global count_t* running,
+                             __global const count_t* reference,
+                             __global float* drift,
+                             const int alpha) {
+    __local float partial[256];
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    int channel = get_global_id(1);
+    histogram += channel * NUM_BINS;
+    running += channel * NUM_BINS;
+    reference += channel * NUM_BINS;
+
+    float runningTotal = 0.0f, referenceTotal = 0.0f;
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        count_t blended = (count_t)(((ulong)running[i] * (256 - alpha) + (ulong)histogram[i] * alpha + 128) >> 8);
+        running[i] = blended;
+        histogram[i] = blended;
+        runningTotal += blended;
+        referenceTotal += reference[i];
+    }
+    runningTotal = groupSum(partial, runningTotal);
+    referenceTotal = groupSum(partial, referenceTotal);
+
+    float distance = 0.0f;
+    if (runningTotal > 0.0f && referenceTotal > 0.0f) {
+        for (int i = lid; i < NUM_BINS; i += groupSize) {
+            distance += fabs(running[i] / runningTotal - reference[i] / referenceTotal);
+        }
+    }
+    distance = groupSum(partial, distance);
+    if (lid == 0) {
+        drift[channel] = (runningTotal > 0.0f && referenceTotal > 0.0f) ? 0.5f * distance : 1.0f;
+    }
+}
+
+// Work-items map 16 pixels per uchar16 load and store, walking the plane with a grid stride
+// so the host can choose how many vectors each one maps; the last partial vector is mapped
+// one pixel at a time
+__kernel void applyLUT(__global const uchar* inputImage,
+                      __global const int* lut,
+                      __global uchar* outputImage,
+                      const int totalPixels) {
+    int channel = get_global_id(1);
+    inputImage += (size_t)channel * totalPixels;
+    outputImage += (size_t)channel * totalPixels;
+    lut += channel * NUM_BINS;
+    int vectorCount = (totalPixels + 15) / 16;
+    for (int v = get_global_id(0); v < vectorCount; v += get_global_size(0)) {
+        int first = v * 16;
+        if (first + 16 <= totalPixels) {
+            uchar16 pixels = vload16(v, inputImage);
+            uchar16 mapped;
+            mapped.s0 = (uchar)lut[binOf(pixels.s0)];
+            mapped.s1 = (uchar)lut[binOf(pixels.s1)];
+            mapped.s2 = (uchar)lut[binOf(pixels.s2)];
+            mapped.s3 = (uchar)lut[binOf(pixels.s3)];
+            mapped.s4 = (uchar)lut[binOf(pixels.s4)];
+            mapped.s5 = (uchar)lut[binOf(pixels.s5)];
+            mapped.s6 = (uchar)lut[binOf(pixels.s6)];
+            mapped.s7 = (uchar)lut[binOf(pixels.s7)];
+            mapped.s8 = (uchar)lut[binOf(pixels.s8)];
+            mapped.s9 = (uchar)lut[binOf(pixels.s9)];
+            mapped.sa = (uchar)lut[binOf(pixels.sa)];
+            mapped.sb = (uchar)lut[binOf(pixels.sb)];
+            mapped.sc = (uchar)lut[binOf(pixels.sc)];
+            mapped.sd = (uchar)lut[binOf(pixels.sd)];
+            mapped.se = (uchar)lut[binOf(pixels.se)];
+            mapped.sf = (uchar)lut[binOf(pixels.sf)];
+            vstore16(mapped, v, outputImage);
+        } else {
+            for (int i = first; i < totalPixels; i++) {
+                outputImage[i] = (uchar)lut[binOf(inputImage[i])];
+            }
+        }
+    }
+}
+
+// Luma mode for RGB images (three planes): one histogram of the BT.601 luma
+// Y = 0.299 R + 0.587 G + 0.114 B, computed on the fly, and one LUT applied to it. Adding
+// Y' - Y to all three channels keeps the chroma differences B - Y and R - Y (Cb, Cr), so
+// colours keep their hue instead of each channel being stretched on its own. Histograms
+// and LUTs are a single NUM_BINS row; NDRanges use only dimension 0, with the launch shapes of
+// the per-channel histogram and apply kernels.
+
+// Integer BT.601 luma (weights scaled by 65536, rounded)
+uint lumaOf(uint r, uint g, uint b) {
+    return (r * 19595u + g * 38470u + b * 7471u + 32768u) >> 16;
+}
+
+// Luma of sixteen pixels at once, from one uchar16 vector of each plane
+uint16 lumaOfVector(__global const uchar* image, const int totalPixels, int v) {
+    uint16 r = convert_uint16(vload16(v, image));
+    uint16 g = convert_uint16(vload16(v, image + totalPixels));
+    uint16 b = convert_uint16(vload16(v, image + 2 * (size_t)totalPixels));
+    return (r * 19595u + g * 38470u + b * 7471u + 32768u) >> 16;
+}
+
+// Counts like calculateHistogram: the grid strides over uchar16 vectors of the three planes,
+// with HIST_REPLICAS copies of the local histogram
+__kernel void calculateLumaHistogram(__global const uchar* image,
+                                     __global count_t* histogram,
+                                     const int totalPixels) {
+    __local int localHist[256 * HIST_REPLICAS];
+    clearLocalHistogram(localHist, HIST_REPLICAS);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __local int* hist = localReplica(localHist, HIST_REPLICAS);
+    int stride = get_global_size(0);
+    int vectorCount = totalPixels / 16;
+    for (int i = get_global_id(0); i < vectorCount; i += stride) {
+        uint16 y = lumaOfVector(image, totalPixels, i);
+        atomic_add(&hist[binOf(y.s0)], 1);
+        atomic_add(&hist[binOf(y.s1)], 1);
+        atomic_add(&hist[binOf(y.s2)], 1);
+        atomic_add(&hist[binOf(y.s3)], 1);
+        atomic_add(&hist[binOf(y.s4)], 1);
+        atomic_add(&hist[binOf(y.s5)], 1);
+        atomic_add(&hist[binOf(y.s6)], 1);
+        atomic_add(&hist[binOf(y.s7)], 1);
+        atomic_add(&hist[binOf(y.s8)], 1);
+        atomic_add(&hist[binOf(y.s9)], 1);
+        atomic_add(&hist[binOf(y.sa)], 1);
+        atomic_add(&hist[binOf(y.sb)], 1);
+        atomic_add(&hist[binOf(y.sc)], 1);
+        atomic_add(&hist[binOf(y.sd)], 1);
+        atomic_add(&hist[binOf(y.se)], 1);
+        atomic_add(&hist[binOf(y.sf)], 1);
+    }
+    for (int i = vectorCount * 16 + get_global_id(0); i < totalPixels; i += stride) {
+        atomic_add(&hist[binOf(lumaOf(image[i], image[(size_t)totalPixels + i], image[2 * (size_t)totalPixels + i]))], 1);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalHistogram(localHist, HIST_REPLICAS, histogram);
+}
+
+// Converts to YCbCr, maps the luma through the LUT and converts back in one pass. Like
+// applyLUT, each work-item maps uchar16 vectors of the three planes with a grid stride.
+__kernel void applyLumaLUT(__global const uchar* inputImage,
+                           __global const int* lut,
+                           __global uchar* outputImage,
+                           const int totalPixels) {
+    int vectorCount = (totalPixels + 15) / 16;
+    for (int v = get_global_id(0); v < vectorCount; v += get_global_size(0)) {
+        int first = v * 16;
+        if (first + 16 <= totalPixels) {
+            uint16 y = lumaOfVector(inputImage, totalPixels, v);
+            int16 mapped;
+            mapped.s0 = lut[binOf(y.s0)];
+            mapped.s1 = lut[binOf(y.s1)];
+            mapped.s2 = lut[binOf(y.s2)];
+            mapped.s3 = lut[binOf(y.s3)];
+            mapped.s4 = lut[binOf(y.s4)];
+            mapped.s5 = lut[binOf(y.s5)];
+            mapped.s6 = lut[binOf(y.s6)];
+            mapped.s7 = lut[binOf(y.s7)];
+            mapped.s8 = lut[binOf(y.s8)];
+            mapped.s9 = lut[binOf(y.s9)];
+            mapped.sa = lut[binOf(y.sa)];
+            mapped.sb = lut[binOf(y.sb)];
+            mapped.sc = lut[binOf(y.sc)];
+            mapped.sd = lut[binOf(y.sd)];
+            mapped.se = lut[binOf(y.se)];
+            mapped.sf = lut[binOf(y.sf)];
+            int16 delta = mapped - convert_int16(y);
+            for (int c = 0; c < 3; c++) {
+                size_t plane = c * (size_t)totalPixels;
+                int16 value = convert_int16(vload16(v, inputImage + plane)) + delta;
+                vstore16(convert_uchar16_sat(value), v, outputImage + plane);
+            }
+        } else {
+            for (int i = first; i < totalPixels; i++) {
+                int r = inputImage[i];
+                int g = inputImage[(size_t)totalPixels + i];
+                int b = inputImage[2 * (size_t)totalPixels + i];
+                int y = lumaOf(r, g, b);
+                int delta = lut[binOf(y)] - y;
+                outputImage[i] = (uchar)clamp(r + delta, 0, MAX_VALUE);
+                outputImage[(size_t)totalPixels + i] = (uchar)clamp(g + delta, 0, MAX_VALUE);
+                outputImage[2 * (size_t)totalPixels + i] = (uchar)clamp(b + delta, 0, MAX_VALUE);
+            }
+        }
+    }
+}
+
+// CLAHE (contrast-limited adaptive histogram equalization). Each channel plane is split into
+// tiles of tileWidth x tileHeight pixels, numbered row-major (tiles in the last row and column
+// may be smaller). Tile histograms and LUTs are one NUM_BINS-long row per tile, with all tiles
+// of channel 0 first. Every kernel launches one work-group per tile in dimension 0.
+
+// Bounds of this work-group's tile
+void tileBounds(const int width, const int height, const int tileWidth, const int tileHeight,
+                int* x0, int* y0, int* x1, int* y1) {
+    int tilesX = (width + tileWidth - 1) / tileWidth;
+    int tile = get_group_id(0);
+    *x0 = (tile % tilesX) * tileWidth;
+    *y0 = (tile / tilesX) * tileHeight;
+    *x1 = min(*x0 + tileWidth, width);
+    *y1 = min(*y0 + tileHeight, height);
+}
+
+// Along one axis of extent pixels split into tiles of tileSize (the last one possibly smaller),
+// finds the two tiles whose centres surround pixel p and returns the weight of the second.
+// Centres are the midpoints of the clipped tile bounds, so a short last tile is centred on
+// itself; pixels outside the outermost centres get a single tile and weight 0.
+float tileBlend(const int p, const int tileSize, const int tiles, const int extent, int* t0, int* t1) {
+    float pos = p + 0.5f;
+    float lastCentre = ((tiles - 1) * tileSize + extent) * 0.5f;
+    int t = (pos >= lastCentre) ? tiles - 1 : (int)floor(pos / tileSize - 0.5f);
+    *t0 = clamp(t, 0, tiles - 1);
+    *t1 = min(t + 1, tiles - 1);
+    if (t < 0 || *t0 == *t1) {
+        return 0.0f;
+    }
+    float c0 = (t + 0.5f) * tileSize;
+    float c1 = (t + 1 == tiles - 1) ? lastCentre : c0 + tileSize;
+    return (pos - c0) / (c1 - c0);
+}
+
+// Counts each tile into a local histogram with the whole work-group and writes its row; no
+// global atomics are needed because every tile belongs to exactly one work-group
+__kernel void calculateTileHistograms(__global const uchar* image,
+                                      __global int* tileHistograms,
+                                      const int width,
+                                      const int height,
+                                      const int tileWidth,
+                                      const int tileHeight) {
+    __local int localHist[256];
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    int channel = get_global_id(1);
+    image += (size_t)channel * width * height;
+    tileHistograms += ((size_t)channel * get_num_groups(0) + get_group_id(0)) * NUM_BINS;
+
+    int x0, y0, x1, y1;
+    tileBounds(width, height, tileWidth, tileHeight, &x0, &y0, &x1, &y1);
+    int w = x1 - x0;
+    int tilePixels = w * (y1 - y0);
+
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        localHist[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Walk the tile as one flat range so narrow tiles still keep every work-item busy
+    for (int i = lid; i < tilePixels; i += groupSize) {
+        int x = x0 + i % w;
+        int y = y0 + i / w;
+        atomic_add(&localHist[binOf(image[(size_t)y * width + x])], 1);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        tileHistograms[i] = localHist[i];
+    }
+}
+
+// Clips each tile histogram at clipLimit * tilePixels / NUM_BINS counts (clipLimit <= 0
+// disables clipping), spreads the clipped excess evenly over all bins and scans the result
+// into the tile's LUT with the same exclusive mapping as normalizeLUT, so a single unclipped
+// tile reproduces global equalization
+__kernel void buildTileLUTs(__global const int* tileHistograms,
+                            __global int* tileLUTs,
+                            const int width,
+                            const int height,
+                            const int tileWidth,
+                            const int tileHeight,
+                            const float clipLimit) {
+    __local int hist[256];
+    __local int temp[256];
+    __local int excess;
+    int lid = get_local_id(0);
+    int groupSize = get_local_size(0);
+    int channel = get_global_id(1);
+    size_t row = ((size_t)channel * get_num_groups(0) + get_group_id(0)) * NUM_BINS;
+    tileHistograms += row;
+    tileLUTs += row;
+
+    int x0, y0, x1, y1;
+    tileBounds(width, height, tileWidth, tileHeight, &x0, &y0, &x1, &y1);
+    int tilePixels = (x1 - x0) * (y1 - y0);
+    int limit = (clipLimit > 0.0f) ? max((int)(clipLimit * tilePixels / NUM_BINS), 1) : tilePixels;
+
+    if (lid == 0) {
+        excess = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        int count = tileHistograms[i];
+        if (count > limit) {
+            atomic_add(&excess, count - limit);
+            count = limit;
+        }
+        hist[i] = count;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Every bin gets an equal share; the remainder goes to evenly spaced bins
+    int share = excess / NUM_BINS;
+    int residual = excess % NUM_BINS;
+    int step = (residual > 0) ? NUM_BINS / residual : 1;
+    for (int i = lid; i < NUM_BINS; i += groupSize) {
+        hist[i] += share + ((residual > 0 && i % step == 0 && i / step < residual) ? 1 : 0);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int carry = 0;
+    for (int base = 0; base < NUM_BINS; base += groupSize) {
+        int i = base + lid;
+        int value = (i < NUM_BINS) ? hist[i] : 0;
+        temp[lid] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < groupSize; offset *= 2) {
+            int val = (lid >= offset) ? temp[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            temp[lid] += val;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (i < NUM_BINS) {
+            int cumulative = carry + temp[lid] - value;
+            tileLUTs[i] = lutValue(cumulative, tilePixels);
+        }
+        carry += temp[groupSize - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Maps every pixel through the LUTs of the four tiles whose centres surround it, blended
+// bilinearly by its distance to those centres; pixels outside the outermost centres use the
+// nearest tiles only
+__kernel void applyCLAHE(__global const uchar* inputImage,
+                         __global const int* tileLUTs,
+                         __global uchar* outputImage,
+                         const int width,
+                         const int height,
+                         const int tileWidth,
+                         const int tileHeight) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    int totalPixels = width * height;
+    if (gid >= totalPixels) {
+        return;
+    }
+    int tilesX = (width + tileWidth - 1) / tileWidth;
+    int tilesY = (height + tileHeight - 1) / tileHeight;
+    inputImage += (size_t)channel * totalPixels;
+    outputImage += (size_t)channel * totalPixels;
+    tileLUTs += (size_t)channel * tilesX * tilesY * NUM_BINS;
+
+    int tx0, tx1, ty0, ty1;
+    float wx = tileBlend(gid % width, tileWidth, tilesX, width, &tx0, &tx1);
+    float wy = tileBlend(gid / width, tileHeight, tilesY, height, &ty0, &ty1);
+
+    int bin = binOf(inputImage[gid]);
+    float top = mix((float)tileLUTs[(ty0 * tilesX + tx0) * NUM_BINS + bin], (float)tileLUTs[(ty0 * tilesX + tx1) * NUM_BINS + bin], wx);
+    float bottom = mix((float)tileLUTs[(ty1 * tilesX + tx0) * NUM_BINS + bin], (float)tileLUTs[(ty1 * tilesX + tx1) * NUM_BINS + bin], wx);
+    outputImage[gid] = (uchar)(mix(top, bottom, wy) + 0.5f);
+}
+
+// Converts an interleaved 8-bit PGM/PPM payload (as stored in the file) to the planar layout.
+// Single-channel payloads are already planar and skip this kernel.
+__kernel void unpackPnm(__global const uchar* packed,
+                        __global uchar* image,
+                        const int totalPixels) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    int channels = get_global_size(1);
+    if (gid < totalPixels) {
+        image[(size_t)channel * totalPixels + gid] = packed[(size_t)gid * channels + channel];
+    }
+}
+
+// Converts a planar image back to an interleaved 8-bit PGM/PPM payload
+__kernel void packPnm(__global const uchar* image,
+                      __global uchar* packed,
+                      const int totalPixels) {
+    int gid = get_global_id(0);
+    int channel = get_global_id(1);
+    int channels = get_global_size(1);
+    if (gid < totalPixels) {
+        packed[(size_t)gid * channels + channel] = image[(size_t)channel * totalPixels + gid];
+    }
+}
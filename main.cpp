@@ -1,27 +1,28 @@
 #include <iostream>
 #include <vector>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <filesystem>
+#include <climits>
 #include "Utils.h" // Assumed to include OpenCL headers
+#include "Equalizer.h"
+#include "ProgramCache.h"
+#include "Pnm.h"
+#include "NativeEqualizer.h"
+#include "MultiDeviceEqualizer.h"
+#include "TemporalEqualizer.h"
+#include "VideoStream.h"
+#include "Autotuner.h"
 #include "CImg.h"
 
 using namespace cimg_library;
 using namespace std;
 
-// Loads OpenCL kernel source code from a file
-string loadKernelSource(const string& filename) {
-    ifstream kernel_file(filename);
-    if (!kernel_file.is_open()) {
-        cerr << "Error opening kernel file: " << filename << endl;
-        exit(1);
-    }
-    stringstream kernel_source;
-    kernel_source << kernel_file.rdbuf();
-    return kernel_source.str();
-}
-
 // Creates a histogram visualization image
-CImg<unsigned char> createHistogramImage(const vector<int>& histogram, int maxHeight = 200) {
-    int maxFreq = *max_element(histogram.begin(), histogram.end());
+template <typename T>
+CImg<unsigned char> createHistogramImage(const vector<T>& histogram, int maxHeight = 200) {
+    T maxFreq = *max_element(histogram.begin(), histogram.end());
     CImg<unsigned char> histImg(280, maxHeight + 30, 1, 3, 255);
     const unsigned char black[] = {0, 0, 0}, white[] = {255, 255, 255}, gray[] = {169, 169, 169};
 
@@ -49,16 +50,664 @@ CImg<unsigned char> createHistogramImage(const vector<int>& histogram, int maxHe
     return histImg;
 }
 
+// Prints every profiled command's queued/submit/start/end timestamps relative to the first
+// command queued, then the device time spent in kernels and transfers next to the host wall time
+void printProfilingReport(const vector<ProfiledCommand>& profile, long long host_ns) {
+    if (profile.empty()) return;
+    cl_ulong origin = profile[0].event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+    cl_ulong first_start = profile[0].event.getProfilingInfo<CL_PROFILING_COMMAND_START>(), last_end = 0;
+    cl_ulong kernel_ns = 0, transfer_ns = 0;
+    cout << "\nDevice profile (ns from first command queued):" << endl;
+    for (const auto& command : profile) {
+        cl_ulong queued = command.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+        cl_ulong submit = command.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+        cl_ulong start = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong end = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        cout << "  " << command.name << ": queued " << queued - origin << ", submit " << submit - origin
+             << ", start " << start - origin << ", end " << end - origin << endl;
+        cout << "    " << GetFullProfilingInfo(command.event, PROF_NS) << endl;
+        (command.transfer ? transfer_ns : kernel_ns) += end - start;
+        first_start = min(first_start, start);
+        last_end = max(last_end, end);
+    }
+    cout << "Kernel Time: " << kernel_ns << "ns, Transfer Time: " << transfer_ns << "ns, Device Span: " << last_end - first_start
+         << "ns, Host Wall Time: " << host_ns << "ns (host overhead " << host_ns - static_cast<long long>(kernel_ns + transfer_ns) << "ns)" << endl;
+}
+
+// True when an OpenCL runtime with at least one platform is installed; without an ICD,
+// clGetPlatformIDs fails and the native backend is used instead
+bool openclAvailable() {
+    try {
+        vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        return !platforms.empty();
+    } catch (const cl::Error&) {
+        return false;
+    }
+}
+
+// Picks the requested platform and device, falling back to any device type when none of the
+// requested type exists. Prints what is available and returns false when the indices are invalid.
+bool selectDevice(int selected_platform, int selected_device, const string& device_type_str, cl::Platform& platform, cl::Device& device) {
+    vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    if (platforms.empty()) {
+        cerr << "No OpenCL platforms available on this system." << endl;
+        return false;
+    }
+    if (selected_platform >= static_cast<int>(platforms.size())) {
+        cerr << "Invalid platform index: " << selected_platform << ". Only " << platforms.size() << " platforms available." << endl;
+        return false;
+    }
+    platform = platforms[selected_platform];
+    cout << "Platform: " << platform.getInfo<CL_PLATFORM_NAME>() << endl;
+
+    // Determine device type from command-line argument
+    cl_device_type requested_type = (device_type_str == "cpu") ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU;
+
+    // Get all devices for the platform first
+    vector<cl::Device> devices;
+    try {
+        platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    } catch (const cl::Error& e) {
+        cerr << "Failed to retrieve devices on platform " << selected_platform << ": " << e.what() << " (" << e.err() << ")" << endl;
+        return false;
+    }
+
+    if (devices.empty()) {
+        cerr << "No devices available on platform " << selected_platform << ". Available platforms and devices:" << endl;
+        for (size_t i = 0; i < platforms.size(); ++i) {
+            cout << "Platform " << i << ": " << platforms[i].getInfo<CL_PLATFORM_NAME>() << endl;
+            vector<cl::Device> avail_devices;
+            try {
+                platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &avail_devices);
+                for (size_t j = 0; j < avail_devices.size(); ++j) {
+                    string type = (avail_devices[j].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU) ? "GPU" : "CPU";
+                    cout << "  Device " << j << ": " << avail_devices[j].getInfo<CL_DEVICE_NAME>() << " (" << type << ")" << endl;
+                }
+            } catch (const cl::Error& e) {
+                cout << "  No devices available: " << e.what() << " (" << e.err() << ")" << endl;
+            }
+        }
+        return false;
+    }
+
+    // Filter devices by requested type
+    vector<cl::Device> filtered_devices;
+    for (const auto& dev : devices) {
+        if (dev.getInfo<CL_DEVICE_TYPE>() == requested_type) {
+            filtered_devices.push_back(dev);
+        }
+    }
+
+    if (filtered_devices.empty()) {
+        cout << "No " << (requested_type == CL_DEVICE_TYPE_GPU ? "GPU" : "CPU") 
+             << " devices found on platform " << selected_platform << ". Falling back to available device." << endl;
+        filtered_devices = devices;
+    }
+
+    if (selected_device >= static_cast<int>(filtered_devices.size())) {
+        cerr << "Invalid device index: " << selected_device << ". Only " << filtered_devices.size() 
+             << " devices available for type " << (requested_type == CL_DEVICE_TYPE_GPU ? "GPU" : "CPU") 
+             << " on platform " << selected_platform << "." << endl;
+        cout << "Available devices on platform " << selected_platform << ":" << endl;
+        for (size_t j = 0; j < devices.size(); ++j) {
+            string type = (devices[j].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU) ? "GPU" : "CPU";
+            cout << "  Device " << j << ": " << devices[j].getInfo<CL_DEVICE_NAME>() << " (" << type << ")" << endl;
+        }
+        return false;
+    }
+
+    device = filtered_devices[selected_device];
+    cl_device_type device_type = device.getInfo<CL_DEVICE_TYPE>();
+    cout << "Device: " << device.getInfo<CL_DEVICE_NAME>()
+         << " (" << (device_type == CL_DEVICE_TYPE_GPU ? "GPU" : "CPU") << ")" << endl;
+    return true;
+}
+
+// Adds the PGM/PPM images named by path to files: every .pgm/.ppm/.pnm in a directory (sorted),
+// a single image, or a list file with one image path per line
+void collectBatchImages(const string& path, vector<string>& files) {
+    auto is_pnm = [](const filesystem::path& file) {
+        string ext = file.extension().string();
+        transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        return ext == ".pgm" || ext == ".ppm" || ext == ".pnm";
+    };
+    if (filesystem::is_directory(path)) {
+        vector<string> found;
+        for (const auto& entry : filesystem::directory_iterator(path)) {
+            if (entry.is_regular_file() && is_pnm(entry.path())) {
+                found.push_back(entry.path().string());
+            }
+        }
+        sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    } else if (is_pnm(path)) {
+        files.push_back(path);
+    } else {
+        ifstream list(path);
+        if (!list.is_open()) {
+            cerr << "Cannot open batch input: " << path << endl;
+            return;
+        }
+        string line;
+        while (getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) files.push_back(line);
+        }
+    }
+}
+
+// Bit depth of a decoded image. Binary PGM/PPM files go by their header maxval, as in batch
+// mode, where the payload is never scanned; other formats by their largest sample. Both the
+// single-image and batch paths use this, so a file is equalized the same way in either. A
+// 16-bit PGM/PPM whose samples all fit in 8 bits therefore runs through the 16-bit kernels
+// (and keeps its 16-bit range), where it used to be treated as 8-bit.
+int imageBitDepth(const string& filename, const CImg<unsigned short>& image) {
+    PnmImage pnm;
+    if (pnm.open(filename)) {
+        return pnm.bytesPerSample() * 8;
+    }
+    return (image.max() > 255) ? 16 : 8;
+}
+
+// Interleaves a planar CImg image into a PGM/PPM payload (big-endian when 16-bit), for batch
+// inputs the memory-mapped reader does not handle
+void packPnmPayload(const CImg<unsigned short>& image, int bit_depth, vector<unsigned char>& payload) {
+    int channels = image.spectrum();
+    size_t total_pixels = static_cast<size_t>(image.width()) * image.height();
+    int bytes = (bit_depth == 8) ? 1 : 2;
+    payload.resize(total_pixels * channels * bytes);
+    for (int c = 0; c < channels; c++) {
+        const unsigned short* plane = image.data(0, 0, 0, c);
+        for (size_t i = 0; i < total_pixels; i++) {
+            unsigned char* sample = &payload[(i * channels + c) * bytes];
+            if (bytes == 1) {
+                sample[0] = static_cast<unsigned char>(plane[i]);
+            } else {
+                sample[0] = static_cast<unsigned char>(plane[i] >> 8);
+                sample[1] = static_cast<unsigned char>(plane[i] & 0xFF);
+            }
+        }
+    }
+}
+
+// One in-flight image of the batch pipeline: its memory-mapped input and output payload (which
+// must outlive the non-blocking transfers), an Equalizer per bit depth, and the event of its
+// download
+struct BatchSlot {
+    string file;
+    PnmImage input;
+    vector<unsigned char> converted, output;
+    int width = 0, height = 0, channels = 0, bit_depth = 8;
+    map<int, unique_ptr<Equalizer>> equalizers;
+    cl::Event done;
+    bool busy = false;
+};
+
+// Opens slot.file and returns its PGM/PPM payload, or nullptr (with a message) when it cannot
+// be read. Binary PGM/PPM payloads come straight from the file mapping; anything else CImg can
+// read (e.g. ASCII PNM) is converted to the same layout on the host.
+unsigned char* loadBatchImage(BatchSlot& slot) {
+    if (slot.input.open(slot.file)) {
+        slot.width = slot.input.width;
+        slot.height = slot.input.height;
+        slot.channels = slot.input.channels;
+        slot.bit_depth = slot.input.bytesPerSample() * 8;
+        return slot.input.pixels();
+    }
+    CImg<unsigned short> image;
+    try {
+        image.load(slot.file.c_str());
+    } catch (const CImgException& e) {
+        cerr << "Skipping " << slot.file << ": " << e.what() << endl;
+        return nullptr;
+    }
+    slot.width = image.width();
+    slot.height = image.height();
+    slot.channels = image.spectrum();
+    slot.bit_depth = imageBitDepth(slot.file, image);
+    packPnmPayload(image, slot.bit_depth, slot.converted);
+    return slot.converted.data();
+}
+
+// Writes slot.output under output_dir with the input file name; returns false on failure
+bool writeBatchImage(const BatchSlot& slot, const string& output_dir) {
+    string output_path = (filesystem::path(output_dir) / filesystem::path(slot.file).filename()).string();
+    PnmWriter writer;
+    if (writer.open(output_path, slot.width, slot.height, slot.channels, slot.bit_depth == 8 ? 255 : 65535)) {
+        writer.write(slot.output.data(), slot.output.size());
+    }
+    if (!writer.close()) {
+        cerr << "Failed to write " << output_path << endl;
+        return false;
+    }
+    return true;
+}
+
+// Golden histograms for -match and -save-hist are text files: a "<bins> <rows>" header line,
+// then one line of bin counts per histogram row (channel, or luma)
+bool isHistogramFile(const string& filename) {
+    return filesystem::path(filename).extension() == ".hist";
+}
+
+bool loadHistogramFile(const string& filename, vector<long long>& histogram, int& bins) {
+    ifstream in(filename);
+    int rows = 0;
+    if (!(in >> bins >> rows) || bins <= 0 || rows <= 0) {
+        cerr << "Invalid histogram file: " << filename << endl;
+        return false;
+    }
+    histogram.resize(static_cast<size_t>(bins) * rows);
+    for (auto& count : histogram) {
+        if (!(in >> count)) {
+            cerr << "Histogram file " << filename << " holds fewer than " << bins << " x " << rows << " counts" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool saveHistogramFile(const string& filename, const vector<long long>& histogram, int bins) {
+    ofstream out(filename);
+    out << bins << " " << histogram.size() / bins << "\n";
+    for (size_t i = 0; i < histogram.size(); i++) {
+        out << histogram[i] << ((i + 1) % bins == 0 ? "\n" : " ");
+    }
+    out.close();
+    if (out.fail()) {
+        cerr << "Failed to write " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+// Headless batch mode: equalizes every image with one context and one program per bit depth,
+// writes the results under output_dir with the input file names and reports aggregate
+// throughput. No windows are opened. Images rotate through num_slots slots, each with its own
+// device buffers; uploads, kernels and downloads run on three in-order queues linked by events,
+// so image N+1 uploads while image N computes and image N-1 downloads, and the host decodes and
+// encodes images while the device works.
+int runBatch(const vector<string>& inputs, const string& output_dir, const cl::Context& context, const cl::Device& device,
+             int num_slots, int num_bins, bool high_precision_16bit, bool fast_path, bool zero_copy, bool use_program_cache,
+             const ClaheSettings& clahe, const string& match_reference, TuneMode tune_mode) {
+    vector<string> files;
+    for (const auto& input : inputs) {
+        collectBatchImages(input, files);
+    }
+    if (files.empty()) {
+        cerr << "No PGM/PPM images found for batch mode." << endl;
+        return 1;
+    }
+    filesystem::create_directories(output_dir);
+
+    cl::CommandQueue upload_queue(context, device, 0), compute_queue(context, device, 0), download_queue(context, device, 0);
+    vector<BatchSlot> slots(max(1, num_slots));
+    size_t max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+
+    // Programs are specialized per bit depth and built (after tuning) on first use
+    map<int, cl::Program> programs;
+    map<int, KernelTuning> tunings;
+    vector<long long> match_target;
+    int match_bins = 0;
+    int processed = 0, failed = 0;
+    long long total_pixels_processed = 0;
+    chrono::high_resolution_clock::duration build_time{0};
+    auto batch_start = chrono::high_resolution_clock::now();
+
+    // Waits for a slot's download and writes its result
+    auto finishSlot = [&](BatchSlot& slot) {
+        slot.done.wait();
+        if (!writeBatchImage(slot, output_dir)) {
+            failed++;
+        } else {
+            processed++;
+            total_pixels_processed += static_cast<long long>(slot.width) * slot.height * slot.channels;
+        }
+        slot.input.close();
+        slot.busy = false;
+    };
+
+    for (size_t i = 0; i < files.size(); i++) {
+        BatchSlot& slot = slots[i % slots.size()];
+        if (slot.busy) {
+            finishSlot(slot);
+        }
+
+        slot.file = files[i];
+        unsigned char* payload = loadBatchImage(slot);
+        if (!payload) {
+            failed++;
+            continue;
+        }
+
+        int channels = slot.channels, bit_depth = slot.bit_depth;
+        size_t image_pixels = static_cast<size_t>(slot.width) * slot.height;
+        // Batch slots hold whole images in 32-bit-count kernels; larger images need the
+        // single-image path, which streams them in strips with 64-bit counts
+        if (image_pixels > INT_MAX || image_pixels * channels * (bit_depth / 8) > max_alloc) {
+            cerr << "Skipping " << slot.file << ": " << slot.width << "x" << slot.height
+                 << " is too large for batch mode; equalize it on its own with -i" << endl;
+            slot.input.close();
+            failed++;
+            continue;
+        }
+        int total_pixels = static_cast<int>(image_pixels);
+        int max_bins = (bit_depth == 8 || clahe.enabled()) ? 256 : (high_precision_16bit ? 65536 : 256);
+        int bins = (num_bins > 0) ? min(num_bins, max_bins) : max_bins;
+
+        if (programs.find(bit_depth) == programs.end()) {
+            auto build_start = chrono::high_resolution_clock::now();
+            tunings[bit_depth] = Autotuner(context, device, use_program_cache).tuning(bit_depth, bins, tune_mode);
+            if (!buildEqualizerProgram(context, device, bit_depth, bins, use_program_cache, programs[bit_depth], false, tunings[bit_depth].hist_replicas)) {
+                return 1;
+            }
+            build_time += chrono::high_resolution_clock::now() - build_start;
+        }
+        unique_ptr<Equalizer>& equalizer = slot.equalizers[bit_depth];
+        if (!equalizer) {
+            equalizer = make_unique<Equalizer>(context, device, compute_queue, programs[bit_depth], bit_depth);
+            equalizer->useTransferQueues(upload_queue, download_queue);
+            equalizer->enablePackedTransfers();
+            equalizer->setTuning(tunings[bit_depth]);
+            if (zero_copy) {
+                equalizer->enableZeroCopy();
+            }
+        }
+
+        equalizer->prepare(total_pixels, bins, channels);
+        if (clahe.enabled()) {
+            equalizer->prepareCLAHE(slot.width, slot.height, clahe);
+        }
+        slot.output.resize(equalizer->imageSize());
+
+        // Histogram matching: every image is matched to a golden histogram file or, with
+        // "first", to the histogram of the first image
+        if (!match_reference.empty() && match_target.empty()) {
+            if (match_reference == "first") {
+                equalizer->uploadPacked(payload);
+                equalizer->histogram();
+                equalizer->readBins(equalizer->d_hist, match_target);
+                match_bins = bins;
+            } else if (!loadHistogramFile(match_reference, match_target, match_bins)) {
+                return 1;
+            }
+        }
+        if (!match_target.empty() && !equalizer->matchingEnabled()) {
+            equalizer->setMatchTarget(match_target, match_bins);
+        }
+        equalizer->uploadPacked(payload, false);
+        if (clahe.enabled()) {
+            equalizer->applyCLAHE();
+        } else {
+            if (fast_path) {
+                equalizer->fusedHistogramLUT();
+            } else {
+                equalizer->histogram();
+                equalizer->blellochScan();
+                equalizer->normalize();
+            }
+            equalizer->apply();
+        }
+        slot.done = equalizer->downloadPacked(slot.output.data(), false);
+        slot.busy = true;
+
+        // Submit now so the device starts while the host decodes the next image
+        upload_queue.flush();
+        compute_queue.flush();
+        download_queue.flush();
+    }
+
+    // Drain the slots still in flight in submission order
+    for (size_t i = 0; i < slots.size(); i++) {
+        BatchSlot& slot = slots[(files.size() + i) % slots.size()];
+        if (slot.busy) {
+            finishSlot(slot);
+        }
+    }
+
+    auto batch_end = chrono::high_resolution_clock::now();
+    double seconds = chrono::duration<double>(batch_end - batch_start - build_time).count();
+    cout << "Batch: " << processed << " images equalized into " << output_dir << ", " << failed << " skipped ("
+         << slots.size() << " pipeline slots)" << endl;
+    cout << "Program Build Time: " << chrono::duration_cast<chrono::milliseconds>(build_time).count() << "ms" << endl;
+    cout << "Batch Time: " << static_cast<long long>(seconds * 1000) << "ms, "
+         << (seconds > 0 ? processed / seconds : 0) << " images/s, "
+         << (seconds > 0 ? total_pixels_processed / seconds / 1e6 : 0) << " Msamples/s" << endl;
+    return failed > 0 ? 2 : 0;
+}
+
+// Batch mode on the native backend: images are processed one after another, each one spread
+// over all cores
+int runNativeBatch(const vector<string>& inputs, const string& output_dir, int num_bins, bool high_precision_16bit) {
+    vector<string> files;
+    for (const auto& input : inputs) {
+        collectBatchImages(input, files);
+    }
+    if (files.empty()) {
+        cerr << "No PGM/PPM images found for batch mode." << endl;
+        return 1;
+    }
+    filesystem::create_directories(output_dir);
+
+    NativeEqualizer equalizer;
+    BatchSlot slot;
+    vector<unsigned char> planar_input, planar_output;
+    vector<long long> histograms, cumulative;
+    vector<int> luts;
+    int processed = 0, failed = 0;
+    long long total_pixels_processed = 0;
+    auto batch_start = chrono::high_resolution_clock::now();
+
+    for (const auto& file : files) {
+        slot.file = file;
+        const unsigned char* payload = loadBatchImage(slot);
+        if (!payload) {
+            failed++;
+            continue;
+        }
+        // The native backend counts in 64 bits, so any image that fits host memory works
+        size_t total_pixels = static_cast<size_t>(slot.width) * slot.height;
+        int max_bins = (slot.bit_depth == 8) ? 256 : (high_precision_16bit ? 65536 : 256);
+        int bins = (num_bins > 0) ? min(num_bins, max_bins) : max_bins;
+        size_t image_size = total_pixels * slot.channels * (slot.bit_depth / 8);
+
+        equalizer.prepare(total_pixels, bins, slot.channels, slot.bit_depth);
+        planar_input.resize(image_size);
+        planar_output.resize(image_size);
+        slot.output.resize(image_size);
+        equalizer.unpack(payload, planar_input.data());
+        equalizer.equalize(planar_input.data(), planar_output.data(), histograms, cumulative, luts);
+        equalizer.pack(planar_output.data(), slot.output.data());
+
+        if (!writeBatchImage(slot, output_dir)) {
+            failed++;
+        } else {
+            processed++;
+            total_pixels_processed += static_cast<long long>(total_pixels) * slot.channels;
+        }
+        slot.input.close();
+    }
+
+    double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - batch_start).count();
+    cout << "Batch: " << processed << " images equalized into " << output_dir << ", " << failed << " skipped (native backend, "
+         << equalizer.threads() << " threads)" << endl;
+    cout << "Batch Time: " << static_cast<long long>(seconds * 1000) << "ms, "
+         << (seconds > 0 ? processed / seconds : 0) << " images/s, "
+         << (seconds > 0 ? total_pixels_processed / seconds / 1e6 : 0) << " Msamples/s" << endl;
+    return failed > 0 ? 2 : 0;
+}
+
+// Video mode: equalizes a stream of frames (concatenated PGM/PPM images, or headerless raw
+// frames of the given layout) from input to output, either of which may be "-" for
+// stdin/stdout or a FIFO, with a temporally smoothed LUT (-decay 0 or -drift 0 equalizes
+// every frame on its own). Frames are read straight into a pool of two pinned input and two pinned output
+// buffers: while the device equalizes frame N the host writes frame N-1 and reads frame N+1,
+// and nothing is allocated after the first frame. Progress and the sustained frame and byte
+// rates go to stderr, as stdout may carry the frames.
+int runVideo(const string& input, const string& output, const VideoFormat& format, const cl::Context& context, const cl::Device& device,
+             int num_bins, bool high_precision_16bit, bool use_program_cache, float decay, float drift_threshold, TuneMode tune_mode) {
+    FrameReader reader;
+    if (!reader.open(input, format)) {
+        cerr << "Cannot open video input " << input << endl;
+        return 1;
+    }
+    // Frames go through the device whole, with 32-bit counts
+    auto frameTooLarge = [&] {
+        if (static_cast<size_t>(reader.width) * reader.height <= INT_MAX) return false;
+        cerr << "Video frames of " << reader.width << "x" << reader.height << " exceed INT_MAX pixels, which video mode does not support" << endl;
+        return true;
+    };
+    if (reader.format != FrameFormat::Pnm && frameTooLarge()) {
+        return 1;
+    }
+    // The first frame fixes the geometry of PGM/PPM streams before the pool can be sized
+    vector<unsigned char> first;
+    if (!reader.next(first)) {
+        cerr << "No frames in " << input << endl;
+        return 1;
+    }
+    if (frameTooLarge()) {
+        return 1;
+    }
+    FrameWriter writer;
+    if (!writer.open(output)) {
+        cerr << "Cannot open video output " << output << endl;
+        return 1;
+    }
+
+    int bit_depth = reader.bit_depth;
+    int max_bins = (bit_depth == 8) ? 256 : (high_precision_16bit ? 65536 : 256);
+    int bins = (num_bins > 0) ? min(num_bins, max_bins) : max_bins;
+    KernelTuning tuning = Autotuner(context, device, use_program_cache).tuning(bit_depth, bins, tune_mode);
+    cl::Program program;
+    if (!buildEqualizerProgram(context, device, bit_depth, bins, use_program_cache, program, false, tuning.hist_replicas)) {
+        return 1;
+    }
+    cl::CommandQueue queue(context, device);
+    TemporalEqualizer temporal(context, device, queue, program, bit_depth);
+    temporal.setTuning(tuning);
+    if (reader.format == FrameFormat::Pnm) {
+        temporal.enablePackedTransfers();
+    }
+    temporal.prepare(reader.width * reader.height, bins, reader.channels, decay, drift_threshold);
+
+    unique_ptr<PinnedBuffer> inputs[2], outputs[2];
+    for (int i = 0; i < 2; i++) {
+        inputs[i] = make_unique<PinnedBuffer>(context, queue, reader.frameSize());
+        outputs[i] = make_unique<PinnedBuffer>(context, queue, temporal.imageSize());
+    }
+    memcpy(inputs[0]->data, first.data(), first.size());
+    vector<unsigned char>().swap(first);
+    cerr << "Video: " << reader.width << "x" << reader.height << ", " << reader.channels << " channel(s), " << bit_depth
+         << "-bit, " << bins << " bins" << endl;
+
+    // Sustained rates are reported every few seconds for long-running captures
+    const double report_interval = 5.0;
+    auto start = chrono::high_resolution_clock::now(), last_report = start;
+    long long reported_frames = 0;
+    int current = 0;
+    bool more = true;
+    while (more) {
+        cl::Event done = temporal.submitFrame(inputs[current]->data, outputs[current]->data);
+        queue.flush();
+        // The previous frame's input holds the chroma planes written with it, so it is only
+        // refilled afterwards
+        int previous = 1 - current;
+        if (temporal.frameCount() > 1) {
+            writer.write(reader, outputs[previous]->data, inputs[previous]->data + reader.equalizedSize());
+        }
+        more = reader.next(inputs[previous]->data);
+        done.wait();
+        temporal.finishFrame();
+
+        auto now = chrono::high_resolution_clock::now();
+        double window = chrono::duration<double>(now - last_report).count();
+        if (window >= report_interval) {
+            long long window_frames = temporal.frameCount() - reported_frames;
+            cerr << "  " << temporal.frameCount() << " frames: " << window_frames / window << " frames/s, "
+                 << window_frames * static_cast<double>(reader.frameSize()) / window / 1e6 << " MB/s" << endl;
+            last_report = now;
+            reported_frames = temporal.frameCount();
+        }
+        current = previous;
+    }
+    writer.write(reader, outputs[1 - current]->data, inputs[1 - current]->data + reader.equalizedSize());
+    double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+    bool written = writer.close();
+    if (reader.error) {
+        cerr << "Stopped at a malformed or truncated frame after " << temporal.frameCount() << " frames" << endl;
+    }
+    if (!written) {
+        cerr << "Failed to write " << output << endl;
+    }
+    long long frame_count = temporal.frameCount();
+    double bytes = static_cast<double>(frame_count) * reader.frameSize();
+    cerr << "Video: " << frame_count << " frames, " << temporal.rebuildCount() << " LUT rebuilds, "
+         << (seconds > 0 ? frame_count / seconds : 0) << " frames/s, "
+         << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s, "
+         << (seconds > 0 ? frame_count * static_cast<double>(reader.width) * reader.height / seconds / 1e6 : 0) << " Mpixels/s" << endl;
+    return (reader.error || !written) ? 2 : 0;
+}
+
 // Prints command-line usage instructions
 void print_help() {
-    cerr << "Usage: -p <platform> -d <device> -t <type: gpu/cpu> -l (list devices) -b <bins> -c (color) -hp (high-precision 16-bit) -h (help) -i <image>" << endl;
+    cerr << "Usage: [options]\n"
+         << "  -p <platform>                      platform index, default 0\n"
+         << "  -d <device>                        device index, default 0\n"
+         << "  -t <gpu|cpu|native>                device type, default gpu; native runs without OpenCL\n"
+         << "  -l                                 list devices\n"
+         << "  -b <bins>                          histogram bins\n"
+         << "  -c                                 colour\n"
+         << "  -hp                                high-precision 16-bit\n"
+         << "  -f                                 fast path: fused histogram/scan/LUT\n"
+         << "  -zc                                zero-copy host buffers\n"
+         << "  -nc                                no program binary cache\n"
+         << "  -prof                              device event profiling\n"
+         << "  -h                                 this help\n"
+         << "  -i <image>                         input image; binary PGM/PPM are 16-bit when the header\n"
+         << "                                     maxval exceeds 255, other formats when a sample does\n"
+         << "  -batch <dir|list|image>            headless, repeatable\n"
+         << "  -o <output dir>                    batch output directory\n"
+         << "  -slots <n>                         batch pipeline depth\n"
+         << "  -clahe <n|XxY>                     tiled CLAHE\n"
+         << "  -clip <limit>                      CLAHE clip limit, 0 = none\n"
+         << "  -strip <rows>                      out-of-core strip height\n"
+         << "  -md [all]                          split the image across every device of the platform,\n"
+         << "                                     or of all platforms\n"
+         << "  -luma                              equalize colour images by luma only\n"
+         << "  -match <image|file.hist|first>     match a reference histogram; first = first batch image\n"
+         << "  -save-hist <file.hist>             write the input histogram\n"
+         << "  -video <file|->                    equalize a PGM/PPM frame stream with a smoothed LUT\n"
+         << "  -raw <WxH:gray8|gray16le|yuv420p>  headerless video frames, from stdin unless -video\n"
+         << "                                     is given\n"
+         << "  -vout <file|->                     video output, default stdout\n"
+         << "  -decay <0-1>                       history weight per frame in 1/256 steps, default 0.9;\n"
+         << "                                     0, or anything below 0.002, = every frame on its own\n"
+         << "  -drift <0-1>                       LUT rebuild threshold, default 0.02, 0 = rebuild every frame\n"
+         << "  -tune                              use the device's kernel tuning profile, measured on\n"
+         << "                                     first use\n"
+         << "  -retune                            measure the profile again\n"
+         << "  -notune                            default launch shapes (the default)\n";
 }
 
 int main(int argc, char **argv) {
     string image_filename = "mdr16.ppm";
     int selected_platform = 0, selected_device = 0, num_bins = -1;
-    bool list_devices = false, use_color = false, high_precision_16bit = false;
+    bool list_devices = false, use_color = false, high_precision_16bit = false, fast_path = false, zero_copy = false, use_program_cache = true, profiling = false;
     string device_type_str = "gpu"; // Default to GPU
+    vector<string> batch_inputs;
+    string output_dir = "equalized";
+    int num_slots = 3;
+    ClaheSettings clahe;
+    int strip_rows = 0;
+    bool multi_device = false, all_platforms = false, luma_mode = false;
+    string match_reference, save_histogram;
+    string video_input, video_output = "-";
+    VideoFormat video_format;
+    float decay = 0.9f, drift_threshold = 0.02f;
+    TuneMode tune_mode = TuneMode::Off;
 
     // Parse command-line arguments
     for (int i = 1; i < argc; ++i) {
@@ -70,7 +719,51 @@ int main(int argc, char **argv) {
         if (string(argv[i]) == "-b" && i + 1 < argc) { num_bins = stoi(argv[++i]); }
         if (string(argv[i]) == "-c") { use_color = true; }
         if (string(argv[i]) == "-hp") { high_precision_16bit = true; }
+        if (string(argv[i]) == "-f") { fast_path = true; }
+        if (string(argv[i]) == "-zc") { zero_copy = true; }
+        if (string(argv[i]) == "-nc") { use_program_cache = false; }
+        if (string(argv[i]) == "-prof") { profiling = true; }
         if (string(argv[i]) == "-i" && i + 1 < argc) { image_filename = string(argv[++i]); }
+        if (string(argv[i]) == "-batch" && i + 1 < argc) { batch_inputs.push_back(argv[++i]); }
+        if (string(argv[i]) == "-o" && i + 1 < argc) { output_dir = string(argv[++i]); }
+        if (string(argv[i]) == "-slots" && i + 1 < argc) { num_slots = stoi(argv[++i]); }
+        if (string(argv[i]) == "-clahe" && i + 1 < argc) {
+            // Tile grid as <n> or <x>x<y>
+            string grid = argv[++i];
+            size_t sep = grid.find('x');
+            clahe.tiles_x = stoi(grid.substr(0, sep));
+            clahe.tiles_y = (sep == string::npos) ? clahe.tiles_x : stoi(grid.substr(sep + 1));
+        }
+        if (string(argv[i]) == "-clip" && i + 1 < argc) { clahe.clip_limit = stof(argv[++i]); }
+        if (string(argv[i]) == "-strip" && i + 1 < argc) { strip_rows = stoi(argv[++i]); }
+        if (string(argv[i]) == "-luma") { luma_mode = true; }
+        if (string(argv[i]) == "-match" && i + 1 < argc) { match_reference = string(argv[++i]); }
+        if (string(argv[i]) == "-save-hist" && i + 1 < argc) { save_histogram = string(argv[++i]); }
+        if (string(argv[i]) == "-video" && i + 1 < argc) { video_input = string(argv[++i]); }
+        if (string(argv[i]) == "-vout" && i + 1 < argc) { video_output = string(argv[++i]); }
+        if (string(argv[i]) == "-raw" && i + 1 < argc) {
+            if (!video_format.parse(argv[++i])) {
+                cerr << "Invalid raw frame format " << argv[i] << " (expected WxH:gray8, gray16le or yuv420p)" << endl;
+                return 1;
+            }
+            // Raw frames come from stdin (e.g. a capture pipe) unless -video names a file or FIFO
+            if (video_input.empty()) video_input = "-";
+        }
+        if (string(argv[i]) == "-decay" && i + 1 < argc) { decay = stof(argv[++i]); }
+        if (string(argv[i]) == "-drift" && i + 1 < argc) { drift_threshold = stof(argv[++i]); }
+        if (string(argv[i]) == "-tune") { tune_mode = TuneMode::Auto; }
+        if (string(argv[i]) == "-retune") { tune_mode = TuneMode::Force; }
+        if (string(argv[i]) == "-notune") { tune_mode = TuneMode::Off; }
+        if (string(argv[i]) == "-md") {
+            multi_device = true;
+            if (i + 1 < argc && string(argv[i + 1]) == "all") { all_platforms = true; ++i; }
+        }
+    }
+
+    // Frames written to stdout must not be mixed with messages; the frames themselves go
+    // through C stdio, so every cout message is sent to stderr instead
+    if (!video_input.empty() && video_output == "-") {
+        cout.rdbuf(cerr.rdbuf());
     }
 
     // List available platforms and devices if requested
@@ -94,16 +787,61 @@ int main(int argc, char **argv) {
     }
 
     try {
+        // The native backend is requested with -t native and also replaces OpenCL on machines
+        // without a runtime
+        bool use_native = (device_type_str == "native");
+        if (!use_native && !openclAvailable()) {
+            cout << "No OpenCL platforms available, using the native CPU backend." << endl;
+            use_native = true;
+        }
+
+        // Video mode streams frames through one device with a temporally smoothed LUT
+        if (!video_input.empty()) {
+            if (use_native) {
+                cerr << "Video mode needs an OpenCL device." << endl;
+                return 1;
+            }
+            cl::Platform platform;
+            cl::Device device;
+            if (!selectDevice(selected_platform, selected_device, device_type_str, platform, device)) {
+                return 1;
+            }
+            cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(platform)(), 0};
+            cl::Context context({device}, properties);
+            return runVideo(video_input, video_output, video_format, context, device, num_bins, high_precision_16bit, use_program_cache, decay, drift_threshold, tune_mode);
+        }
+
+        // Batch mode sets OpenCL up once and streams every image through it without displays
+        if (!batch_inputs.empty()) {
+            if (use_native) {
+                if (clahe.enabled()) {
+                    cout << "CLAHE needs an OpenCL device; the native backend equalizes globally." << endl;
+                }
+                if (!match_reference.empty()) {
+                    cout << "Histogram matching needs an OpenCL device; the native backend equalizes." << endl;
+                }
+                return runNativeBatch(batch_inputs, output_dir, num_bins, high_precision_16bit);
+            }
+            cl::Platform platform;
+            cl::Device device;
+            if (!selectDevice(selected_platform, selected_device, device_type_str, platform, device)) {
+                return 1;
+            }
+            cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(platform)(), 0};
+            cl::Context context({device}, properties);
+            return runBatch(batch_inputs, output_dir, context, device, num_slots, num_bins, high_precision_16bit, fast_path, zero_copy, use_program_cache, clahe, match_reference, tune_mode);
+        }
+
         // Load input image
         CImg<unsigned short> image_input(image_filename.c_str());
 
         // Determine bit depth and channels
         int width = image_input.width(), height = image_input.height();
-        int total_pixels = width * height;
+        size_t total_pixels = static_cast<size_t>(width) * height;
         int channels = image_input.spectrum();
         use_color = use_color || (channels > 1);
 
-        int bit_depth = (image_input.max() > 255) ? 16 : 8;
+        int bit_depth = imageBitDepth(image_filename, image_input);
         cout << "Image has " << channels << " channels" << endl;
         cout << "Input Image Min: " << image_input.min() << ", Max: " << image_input.max() << endl;
 
@@ -118,268 +856,392 @@ int main(int argc, char **argv) {
         }
         CImgDisplay disp_input(display_input, "Input Image");
 
-        int max_value = (bit_depth == 8) ? 255 : 65535;
-        int max_bins = (bit_depth == 8) ? 256 : (high_precision_16bit ? 65536 : 256);
+        // CLAHE tile histograms live in local memory, so they are limited to 256 bins
+        int max_bins = (bit_depth == 8 || clahe.enabled()) ? 256 : (high_precision_16bit ? 65536 : 256);
         num_bins = (num_bins > 0) ? min(num_bins, max_bins) : max_bins;
 
         cout << "Bit depth: " << bit_depth << "-bit, Channels: " << channels << ", Bins: " << num_bins << endl;
 
-        // Setup OpenCL platform
-        vector<cl::Platform> platforms;
-        cl::Platform::get(&platforms);
-        if (platforms.empty()) {
-            cerr << "No OpenCL platforms available on this system." << endl;
-            return 1;
-        }
-        if (selected_platform >= static_cast<int>(platforms.size())) {
-            cerr << "Invalid platform index: " << selected_platform << ". Only " << platforms.size() << " platforms available." << endl;
-            return 1;
-        }
-        cl::Platform platform = platforms[selected_platform];
-        cout << "Platform: " << platform.getInfo<CL_PLATFORM_NAME>() << endl;
-
-        // Determine device type from command-line argument
-        cl_device_type requested_type = (device_type_str == "cpu") ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU;
-
-        // Get all devices for the platform first
-        vector<cl::Device> devices;
-        try {
-            platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-        } catch (const cl::Error& e) {
-            cerr << "Failed to retrieve devices on platform " << selected_platform << ": " << e.what() << " (" << e.err() << ")" << endl;
-            return 1;
-        }
-
-        if (devices.empty()) {
-            cerr << "No devices available on platform " << selected_platform << ". Available platforms and devices:" << endl;
-            for (size_t i = 0; i < platforms.size(); ++i) {
-                cout << "Platform " << i << ": " << platforms[i].getInfo<CL_PLATFORM_NAME>() << endl;
-                vector<cl::Device> avail_devices;
+        // Luma mode equalizes an RGB image through one histogram of its luma instead of one per
+        // channel, so hues are preserved; histograms and LUTs then have a single row
+        bool luma = luma_mode && channels == 3 && !clahe.enabled() && !use_native && !multi_device;
+        if (luma_mode && !luma) {
+            cout << "Luma mode needs an RGB image on a single OpenCL device without CLAHE; equalizing each channel." << endl;
+        }
+        int hist_channels = luma ? 1 : channels;
+        if (!match_reference.empty() && (use_native || multi_device || clahe.enabled() || match_reference == "first")) {
+            cout << "Histogram matching needs a reference image or .hist file and a single OpenCL device without CLAHE; equalizing instead." << endl;
+            match_reference.clear();
+        }
+
+        // Data structures for histograms and output (one num_bins row per channel)
+        vector<long long> all_histograms, all_cum_histograms, all_hs_cum_histograms;
+        vector<int> all_luts;
+        CImg<unsigned short> final_output(width, height, 1, channels, 0); // Initialize to 0
+
+        // 8-bit images travel as one byte per sample; the unsigned short images above only
+        // feed the debug output and displays
+        CImg<unsigned char> input_8bit, output_8bit;
+        void* device_input = image_input.data();
+        void* device_output = final_output.data();
+        if (bit_depth == 8) {
+            input_8bit = image_input;
+            output_8bit.assign(width, height, 1, channels, 0);
+            device_input = input_8bit.data();
+            device_output = output_8bit.data();
+        }
+
+        // Debug: Check input range and sample values
+        for (int c = 0; c < channels; c++) {
+            const unsigned short* plane = image_input.data(0, 0, 0, c);
+            cout << "Channel " << c << " Input Min: " << *min_element(plane, plane + total_pixels)
+                 << ", Max: " << *max_element(plane, plane + total_pixels) << endl;
+            cout << "Sample Input Values (Top-Left, Mid, Bottom-Right): "
+                 << plane[0] << ", " << plane[total_pixels / 2] << ", " << plane[total_pixels - 1] << endl;
+        }
+
+        chrono::high_resolution_clock::time_point total_start, t_device_end;
+        if (use_native) {
+            // Native backend: the same histogram, scan, LUT and apply passes on host threads,
+            // reading and writing the planar images in place
+            NativeEqualizer native;
+            native.prepare(total_pixels, num_bins, channels, bit_depth);
+            cout << "Backend: native (" << native.threads() << " threads)" << endl;
+            if (clahe.enabled()) {
+                cout << "CLAHE needs an OpenCL device; the native backend equalizes globally." << endl;
+            }
+
+            total_start = chrono::high_resolution_clock::now();
+            native.equalize(device_input, device_output, all_histograms, all_cum_histograms, all_luts);
+            t_device_end = chrono::high_resolution_clock::now();
+            all_hs_cum_histograms = all_cum_histograms;
+            if (bit_depth == 8) {
+                final_output = output_8bit;
+            }
+            cout << "Native Pipeline Time: " << chrono::duration_cast<chrono::milliseconds>(t_device_end - total_start).count() << "ms" << endl;
+        } else if (multi_device) {
+            // Multi-device: every device of the -p platform (or of all platforms) equalizes a band
+            // of rows, with one context and program per device
+            if (total_pixels > INT_MAX) {
+                cerr << "Multi-device bands are limited to INT_MAX pixels; use -strip on a single device for this image." << endl;
+                return 1;
+            }
+            MultiDeviceEqualizer multi(bit_depth);
+            vector<cl::Platform> platforms;
+            cl::Platform::get(&platforms);
+            for (size_t p = 0; p < platforms.size(); p++) {
+                if (!all_platforms && static_cast<int>(p) != selected_platform) continue;
+                vector<cl::Device> devices;
                 try {
-                    platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &avail_devices);
-                    for (size_t j = 0; j < avail_devices.size(); ++j) {
-                        string type = (avail_devices[j].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU) ? "GPU" : "CPU";
-                        cout << "  Device " << j << ": " << avail_devices[j].getInfo<CL_DEVICE_NAME>() << " (" << type << ")" << endl;
+                    platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+                } catch (const cl::Error&) {
+                    continue;
+                }
+                for (const auto& device : devices) {
+                    cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[p])(), 0};
+                    cl::Context context({device}, properties);
+                    cl::Program program;
+                    if (!buildEqualizerProgram(context, device, bit_depth, num_bins, use_program_cache, program)) {
+                        return 1;
                     }
-                } catch (const cl::Error& e) {
-                    cout << "  No devices available: " << e.what() << " (" << e.err() << ")" << endl;
+                    multi.addDevice(context, device, program);
                 }
             }
-            return 1;
-        }
+            if (multi.devices() == 0) {
+                cerr << "No OpenCL devices found for multi-device mode." << endl;
+                return 1;
+            }
+            if (clahe.enabled()) {
+                cout << "CLAHE needs the whole image on one device; multi-device mode equalizes globally." << endl;
+            }
+            if (fast_path || zero_copy || profiling) {
+                cout << "Multi-device mode runs the standard pipeline with copied buffers; -f, -zc and -prof are ignored." << endl;
+            }
 
-        // Filter devices by requested type
-        vector<cl::Device> filtered_devices;
-        for (const auto& dev : devices) {
-            if (dev.getInfo<CL_DEVICE_TYPE>() == requested_type) {
-                filtered_devices.push_back(dev);
+            // A short concurrent probe measures each device before the rows are split
+            if (!multi.prepare(width, height, num_bins, channels)) {
+                cerr << "The devices together cannot allocate this image; use -strip on a single device instead." << endl;
+                return 1;
             }
-        }
+            multi.calibrate(device_input);
+            cout << "Multi-device split over " << multi.devices() << " devices:" << endl;
+            multi.printSplit(cout);
 
-        if (filtered_devices.empty()) {
-            cout << "No " << (requested_type == CL_DEVICE_TYPE_GPU ? "GPU" : "CPU") 
-                 << " devices found on platform " << selected_platform << ". Falling back to available device." << endl;
-            filtered_devices = devices;
-        }
+            total_start = chrono::high_resolution_clock::now();
+            multi.equalize(device_input, device_output, all_histograms, all_cum_histograms, all_luts);
+            t_device_end = chrono::high_resolution_clock::now();
+            all_hs_cum_histograms = all_cum_histograms;
+            if (bit_depth == 8) {
+                final_output = output_8bit;
+            }
+            cout << "Multi-Device Pipeline Time: " << chrono::duration_cast<chrono::milliseconds>(t_device_end - total_start).count() << "ms" << endl;
+        } else {
+            // Setup OpenCL platform and device
+            cl::Platform platform;
+            cl::Device device;
+            if (!selectDevice(selected_platform, selected_device, device_type_str, platform, device)) {
+                return 1;
+            }
 
-        if (selected_device >= static_cast<int>(filtered_devices.size())) {
-            cerr << "Invalid device index: " << selected_device << ". Only " << filtered_devices.size() 
-                 << " devices available for type " << (requested_type == CL_DEVICE_TYPE_GPU ? "GPU" : "CPU") 
-                 << " on platform " << selected_platform << "." << endl;
-            cout << "Available devices on platform " << selected_platform << ":" << endl;
-            for (size_t j = 0; j < devices.size(); ++j) {
-                string type = (devices[j].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU) ? "GPU" : "CPU";
-                cout << "  Device " << j << ": " << devices[j].getInfo<CL_DEVICE_NAME>() << " (" << type << ")" << endl;
+            // Create OpenCL context and command queue
+            cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(platform)(), 0};
+            cl::Context context({device}, properties);
+            // Profiling mode timestamps every transfer and kernel on the device
+            cl::CommandQueue queue(context, device, profiling ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+            // Counts above INT_MAX need 64-bit histograms, scans and LUT math on the device; smaller
+            // images keep the 32-bit kernels
+            bool wide_counts = total_pixels > INT_MAX;
+            if (wide_counts && device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_int64_base_atomics") == string::npos) {
+                cerr << "Error: " << total_pixels << " pixels need 64-bit counts, but the device lacks cl_khr_int64_base_atomics" << endl;
+                return 1;
             }
-            return 1;
-        }
 
-        cl::Device device = filtered_devices[selected_device];
-        cl_device_type device_type = device.getInfo<CL_DEVICE_TYPE>();
-        cout << "Device: " << device.getInfo<CL_DEVICE_NAME>()
-             << " (" << (device_type == CL_DEVICE_TYPE_GPU ? "GPU" : "CPU") << ")" << endl;
+            // Out-of-core: an image whose buffers exceed what the device can allocate, or whose pixel
+            // count overflows the kernels' int sizes, is streamed through the device in strips of rows
+            size_t pixel_bytes = channels * (bit_depth == 8 ? sizeof(unsigned char) : sizeof(unsigned short));
+            size_t max_buffer = min(static_cast<size_t>(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()),
+                                    static_cast<size_t>(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()) / 4);
+            bool too_large = total_pixels * pixel_bytes > max_buffer || total_pixels > INT_MAX;
+            if (too_large && clahe.enabled()) {
+                cerr << "CLAHE needs the whole image on one device and is limited to INT_MAX pixels and the device allocation limit; drop -clahe to equalize this image in strips." << endl;
+                return 1;
+            }
+            // The largest strip the device can hold; a -strip value is clamped to it as well
+            int max_strip_rows = static_cast<int>(max(static_cast<size_t>(1), min(max_buffer / pixel_bytes, static_cast<size_t>(INT_MAX)) / width));
+            if (strip_rows == 0 && too_large) {
+                strip_rows = max_strip_rows;
+            } else if (strip_rows > max_strip_rows && max_strip_rows < height) {
+                cout << "Strips of " << strip_rows << " rows exceed the device's buffer limit; using " << max_strip_rows << endl;
+                strip_rows = max_strip_rows;
+            }
+            bool use_strips = strip_rows > 0 && strip_rows < height;
+            if (use_strips && clahe.enabled()) {
+                cout << "CLAHE needs the whole image on the device; strips disabled." << endl;
+                use_strips = false;
+            }
+            if (use_strips) {
+                cout << "Out-of-core: " << (height + strip_rows - 1) / strip_rows << " strips of " << strip_rows << " rows" << endl;
+            }
 
-        // Create OpenCL context and command queue
-        cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(platform)(), 0};
-        cl::Context context({device}, properties);
-        cl::CommandQueue queue(context, device, 0);
+            // With -tune, launch shapes come from the device's tuning profile, measured on first use
+            KernelTuning tuning = Autotuner(context, device, use_program_cache).tuning(bit_depth, num_bins, tune_mode);
 
-        // Load kernel source based on bit depth
-        string kernelSource = loadKernelSource(bit_depth == 8 ? "kernels/8_bit.cl" : "kernels/16_bit.cl");
-        cl::Program program(context, kernelSource);
-        cl_int buildErr = program.build({device});
-        if (buildErr != CL_SUCCESS) {
-            cerr << "Program build error: " << buildErr << endl;
-            cerr << "Build log: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << endl;
-            return 1;
-        }
+            // Build the kernels for this bit depth and bin count
+            cl::Program program;
+            if (!buildEqualizerProgram(context, device, bit_depth, num_bins, use_program_cache, program, wide_counts, tuning.hist_replicas)) {
+                return 1;
+            }
 
-        // Data structures for histograms and output
-        vector<vector<int>> histograms(channels, vector<int>(num_bins, 0));
-        vector<vector<int>> cum_histograms(channels, vector<int>(num_bins, 0));
-        vector<vector<int>> hs_cum_histograms(channels, vector<int>(num_bins, 0));
-        vector<vector<int>> luts(channels, vector<int>(num_bins, 0));
-        CImg<unsigned short> final_output(width, height, 1, channels, 0); // Initialize to 0
 
-        // Start total execution timer
-        auto total_start = chrono::high_resolution_clock::now();
+            // Device buffers and kernels are created once; every stage covers all channels in one launch
+            Equalizer equalizer(context, device, queue, program, bit_depth, wide_counts);
+            equalizer.setTuning(tuning);
+            if (luma) {
+                equalizer.enableLuma();
+            }
 
-        for (int c = 0; c < channels; c++) {
-            cout << "\nProcessing Channel " << c << "..." << endl;
-            vector<unsigned short> h_input(total_pixels);
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    h_input[y * width + x] = image_input(x, y, 0, c);
+            // Histogram matching: the target is a golden histogram file or the histogram of a
+            // reference image, counted by this equalizer so that binning and luma mode agree
+            if (!match_reference.empty()) {
+                vector<long long> target;
+                int target_bins = num_bins;
+                if (isHistogramFile(match_reference)) {
+                    if (!loadHistogramFile(match_reference, target, target_bins)) {
+                        return 1;
+                    }
+                } else {
+                    CImg<unsigned short> reference(match_reference.c_str());
+                    if (reference.spectrum() != channels || imageBitDepth(match_reference, reference) != bit_depth) {
+                        cerr << "Reference image " << match_reference << " must have the channel count and bit depth of the input" << endl;
+                        return 1;
+                    }
+                    // The reference is counted whole, so it must fit the device like an unstriped input
+                    size_t reference_size = static_cast<size_t>(reference.width()) * reference.height();
+                    if (reference_size > INT_MAX || reference_size * pixel_bytes > max_buffer) {
+                        cerr << "Reference image " << match_reference << " is too large to count on the device; match a .hist file instead" << endl;
+                        return 1;
+                    }
+                    CImg<unsigned char> reference_8bit;
+                    const void* reference_pixels = reference.data();
+                    if (bit_depth == 8) {
+                        reference_8bit = reference;
+                        reference_pixels = reference_8bit.data();
+                    }
+                    equalizer.prepare(static_cast<int>(reference_size), num_bins, channels);
+                    equalizer.upload(reference_pixels);
+                    equalizer.histogram();
+                    equalizer.readBins(equalizer.d_hist, target);
                 }
+                equalizer.setMatchTarget(target, target_bins);
+                cout << "Matching the histogram of " << match_reference << endl;
+            }
+            // Zero-copy: the kernels work in place on aligned host copies of the input and output
+            if (zero_copy && !use_strips) {
+                equalizer.enableZeroCopy();
+            }
+            size_t prepared_pixels = use_strips ? static_cast<size_t>(strip_rows) * width : total_pixels;
+            equalizer.prepare(static_cast<int>(prepared_pixels), num_bins, channels);
+            if (clahe.enabled()) {
+                equalizer.prepareCLAHE(width, height, clahe);
+            }
+            if (profiling) {
+                equalizer.enableProfiling();
             }
 
-            // Debug: Check input range and sample values
-            cout << "Channel " << c << " Input Min: " << *min_element(h_input.begin(), h_input.end())
-                 << ", Max: " << *max_element(h_input.begin(), h_input.end()) << endl;
-            cout << "Sample Input Values (Top-Left, Mid, Bottom-Right): " 
-                 << h_input[0] << ", " << h_input[total_pixels / 2] << ", " << h_input[total_pixels - 1] << endl;
-
-            // OpenCL buffers
-            cl::Buffer d_input(context, CL_MEM_READ_ONLY, total_pixels * sizeof(unsigned short));
-            cl::Buffer d_output(context, CL_MEM_WRITE_ONLY, total_pixels * sizeof(unsigned short));
-            cl::Buffer d_hist(context, CL_MEM_READ_WRITE, num_bins * sizeof(int));
-            cl::Buffer d_cum_hist(context, CL_MEM_READ_WRITE, num_bins * sizeof(int));
-            cl::Buffer d_hs_cum_hist(context, CL_MEM_READ_WRITE, num_bins * sizeof(int));
-            cl::Buffer d_lut(context, CL_MEM_READ_WRITE, num_bins * sizeof(int));
-
-            // Memory transfer to device (input)
-            auto t_mem_start = chrono::high_resolution_clock::now();
-            queue.enqueueWriteBuffer(d_input, CL_TRUE, 0, total_pixels * sizeof(unsigned short), h_input.data());
-            auto t_mem_end = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Memory Write Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
-
-            queue.enqueueFillBuffer(d_hist, 0, 0, num_bins * sizeof(int));
-
-            // Histogram calculation kernel
-            cl::Kernel hist_kernel(program, bit_depth == 8 ? "calculateHistogram" : "calculateHistogram16");
-            hist_kernel.setArg(0, d_input);
-            hist_kernel.setArg(1, d_hist);
-            hist_kernel.setArg(2, total_pixels);
-            hist_kernel.setArg(3, num_bins);
-            hist_kernel.setArg(4, max_value);
-
-            size_t local_size = min(static_cast<size_t>(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()), static_cast<size_t>(256));
-            size_t global_size = ((total_pixels + local_size - 1) / local_size) * local_size;
-
-            auto t1 = chrono::high_resolution_clock::now();
-            queue.enqueueNDRangeKernel(hist_kernel, cl::NullRange, cl::NDRange(global_size), cl::NDRange(local_size));
-            queue.finish();
-            auto t2 = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Histogram Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
-
-            // Read histogram back to host
-            t_mem_start = chrono::high_resolution_clock::now();
-            queue.enqueueReadBuffer(d_hist, CL_TRUE, 0, num_bins * sizeof(int), histograms[c].data());
-            t_mem_end = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Histogram Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
-
-            // Debug: Check histogram
-            int hist_sum = 0;
-            for (int i = 0; i < num_bins; i++) hist_sum += histograms[c][i];
-            cout << "Channel " << c << " Histogram Sum: " << hist_sum << " (should match total_pixels: " << total_pixels << ")" << endl;
-
-            // Blelloch Scan
-            cl::Kernel scan_kernel(program, bit_depth == 8 ? "prefixSum" : "prefixSum16");
-            scan_kernel.setArg(0, d_hist);
-            scan_kernel.setArg(1, d_cum_hist);
-            scan_kernel.setArg(2, num_bins);
-
-            size_t scan_local_size = min(static_cast<size_t>(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()), static_cast<size_t>(num_bins));
-            size_t scan_global_size = ((num_bins + scan_local_size - 1) / scan_local_size) * scan_local_size;
-
-            t1 = chrono::high_resolution_clock::now();
-            queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(scan_global_size), cl::NDRange(scan_local_size));
-            queue.finish();
-            t2 = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Blelloch Scan Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
-
-            t_mem_start = chrono::high_resolution_clock::now();
-            queue.enqueueReadBuffer(d_cum_hist, CL_TRUE, 0, num_bins * sizeof(int), cum_histograms[c].data());
-            t_mem_end = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Blelloch Scan Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
-
-            // Hillis-Steele Scan
-            cl::Kernel hs_scan_kernel(program, bit_depth == 8 ? "hillisSteeleScan" : "hillisSteeleScan16");
-            hs_scan_kernel.setArg(0, d_hist);
-            hs_scan_kernel.setArg(1, d_hs_cum_hist);
-            hs_scan_kernel.setArg(2, num_bins);
-
-            t1 = chrono::high_resolution_clock::now();
-            queue.enqueueNDRangeKernel(hs_scan_kernel, cl::NullRange, cl::NDRange(scan_global_size), cl::NDRange(scan_local_size));
-            queue.finish();
-            t2 = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Hillis-Steele Scan Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
-
-            t_mem_start = chrono::high_resolution_clock::now();
-            queue.enqueueReadBuffer(d_hs_cum_hist, CL_TRUE, 0, num_bins * sizeof(int), hs_cum_histograms[c].data());
-            t_mem_end = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Hillis-Steele Scan Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
-
-            // Normalize LUT using Blelloch scan results
-            cl::Kernel lut_kernel(program, bit_depth == 8 ? "normalizeLUT" : "normalizeLUT16");
-            lut_kernel.setArg(0, d_cum_hist);
-            lut_kernel.setArg(1, d_lut);
-            lut_kernel.setArg(2, total_pixels);
-            lut_kernel.setArg(3, num_bins);
-            lut_kernel.setArg(4, max_value);
-
-            t1 = chrono::high_resolution_clock::now();
-            queue.enqueueNDRangeKernel(lut_kernel, cl::NullRange, cl::NDRange(num_bins), cl::NullRange);
-            queue.finish();
-            t2 = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " LUT Normalization Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
-
-            t_mem_start = chrono::high_resolution_clock::now();
-            queue.enqueueReadBuffer(d_lut, CL_TRUE, 0, num_bins * sizeof(int), luts[c].data());
-            t_mem_end = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " LUT Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
+            if (use_strips) {
+                // Both passes stream the host image through strip-sized device buffers
+                total_start = chrono::high_resolution_clock::now();
+                equalizer.equalizeStrips(device_input, device_output, total_pixels);
+                auto t_strips_end = chrono::high_resolution_clock::now();
+                if (bit_depth == 8) {
+                    final_output = output_8bit;
+                }
+                cout << "Strip Pipeline Time: " << chrono::duration_cast<chrono::milliseconds>(t_strips_end - total_start).count() << "ms" << endl;
+                equalizer.readBins(equalizer.d_hist, all_histograms, false);
+                equalizer.readBins(equalizer.d_cum_hist, all_cum_histograms, false);
+                equalizer.readBins(equalizer.d_lut, all_luts);
+                all_hs_cum_histograms = all_cum_histograms;
+            } else {
+                // Start total execution timer
+                total_start = chrono::high_resolution_clock::now();
 
-            // Debug: Check LUT
-            cout << "Channel " << c << " LUT Min: " << *min_element(luts[c].begin(), luts[c].end())
-                 << ", Max: " << *max_element(luts[c].begin(), luts[c].end()) << endl;
+                // CImg stores channels as contiguous planes, so the whole image goes up in one transfer
+                auto t_mem_start = chrono::high_resolution_clock::now();
+                equalizer.upload(device_input);
+                auto t_mem_end = chrono::high_resolution_clock::now();
+                cout << "Memory Write Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
 
-            // Apply LUT to equalize image
-            cl::Kernel apply_kernel(program, bit_depth == 8 ? "applyLUT" : "applyLUT16");
-            apply_kernel.setArg(0, d_input);
-            apply_kernel.setArg(1, d_lut);
-            apply_kernel.setArg(2, d_output);
-            apply_kernel.setArg(3, total_pixels);
-            apply_kernel.setArg(4, num_bins);
-
-            t1 = chrono::high_resolution_clock::now();
-            queue.enqueueNDRangeKernel(apply_kernel, cl::NullRange, cl::NDRange(global_size), cl::NDRange(local_size));
-            queue.finish();
-            t2 = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Apply LUT Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
-
-            // Read equalized image back to host
-            vector<unsigned short> h_output(total_pixels);
-            t_mem_start = chrono::high_resolution_clock::now();
-            queue.enqueueReadBuffer(d_output, CL_TRUE, 0, total_pixels * sizeof(unsigned short), h_output.data());
-            t_mem_end = chrono::high_resolution_clock::now();
-            cout << "Channel " << c << " Output Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
+                chrono::high_resolution_clock::time_point t1, t2;
+                if (fast_path) {
+                    // Fast path: one fused launch builds the histogram, cumulative histogram and LUT.
+                    // Nothing is waited on or read back until the equalized image is ready.
+                    t1 = chrono::high_resolution_clock::now();
+                    equalizer.fusedHistogramLUT();
+                } else {
+                    t1 = chrono::high_resolution_clock::now();
+                    equalizer.histogram();
+                    queue.finish();
+                    t2 = chrono::high_resolution_clock::now();
+                    cout << "Histogram Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
 
-            // Debug: Check output range and sample values across the image
-            cout << "Channel " << c << " Output Min: " << *min_element(h_output.begin(), h_output.end())
-                 << ", Max: " << *max_element(h_output.begin(), h_output.end()) << endl;
-            cout << "Sample Output Values (Top-Left, Top-Right, Mid, Bottom-Left, Bottom-Right): " 
-                 << h_output[0] << ", " << h_output[width - 1] << ", " << h_output[total_pixels / 2] << ", "
-                 << h_output[(height - 1) * width] << ", " << h_output[total_pixels - 1] << endl;
-
-            // Populate final_output with detailed checking
-            int non_zero_count = 0;
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    unsigned short val = h_output[y * width + x];
-                    final_output(x, y, 0, c) = val;
-                    if (val > 0) non_zero_count++;
+                    // Read histogram back to host
+                    t_mem_start = chrono::high_resolution_clock::now();
+                    equalizer.readBins(equalizer.d_hist, all_histograms);
+                    t_mem_end = chrono::high_resolution_clock::now();
+                    cout << "Histogram Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
+
+                    // Debug: Check histogram
+                    for (int c = 0; c < hist_channels; c++) {
+                        long long hist_sum = 0;
+                        for (int i = 0; i < num_bins; i++) hist_sum += all_histograms[c * num_bins + i];
+                        cout << "Channel " << c << " Histogram Sum: " << hist_sum << " (should match total_pixels: " << total_pixels << ")" << endl;
+                    }
+
+                    // Blelloch Scan
+                    t1 = chrono::high_resolution_clock::now();
+                    equalizer.blellochScan();
+                    queue.finish();
+                    t2 = chrono::high_resolution_clock::now();
+                    cout << "Blelloch Scan Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
+
+                    t_mem_start = chrono::high_resolution_clock::now();
+                    equalizer.readBins(equalizer.d_cum_hist, all_cum_histograms);
+                    t_mem_end = chrono::high_resolution_clock::now();
+                    cout << "Blelloch Scan Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
+
+                    // Hillis-Steele Scan
+                    t1 = chrono::high_resolution_clock::now();
+                    equalizer.hillisSteeleScan();
+                    queue.finish();
+                    t2 = chrono::high_resolution_clock::now();
+                    cout << "Hillis-Steele Scan Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
+
+                    t_mem_start = chrono::high_resolution_clock::now();
+                    equalizer.readBins(equalizer.d_hs_cum_hist, all_hs_cum_histograms);
+                    t_mem_end = chrono::high_resolution_clock::now();
+                    cout << "Hillis-Steele Scan Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
+
+                    // Normalize LUT using Blelloch scan results
+                    t1 = chrono::high_resolution_clock::now();
+                    equalizer.normalize();
+                    queue.finish();
+                    t2 = chrono::high_resolution_clock::now();
+                    cout << "LUT Normalization Time: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
+
+                    t_mem_start = chrono::high_resolution_clock::now();
+                    equalizer.readBins(equalizer.d_lut, all_luts);
+                    t_mem_end = chrono::high_resolution_clock::now();
+                    cout << "LUT Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
+                    t1 = chrono::high_resolution_clock::now();
+                }
+
+                // Apply LUT to equalize image. CLAHE replaces the global LUT with per-tile LUTs; the
+                // global stages above then only feed the histogram displays.
+                if (clahe.enabled()) {
+                    t1 = chrono::high_resolution_clock::now();
+                    equalizer.applyCLAHE();
+                } else {
+                    equalizer.apply();
+                }
+                queue.finish();
+                t2 = chrono::high_resolution_clock::now();
+                cout << (clahe.enabled() ? "CLAHE Time: " : fast_path ? "Fused Pipeline Time: " : "Apply LUT Time: ")
+                     << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << "ms" << endl;
+
+                // Read equalized image back to host, straight into the planar output image
+                t_mem_start = chrono::high_resolution_clock::now();
+                equalizer.download(device_output);
+                t_mem_end = chrono::high_resolution_clock::now();
+                if (bit_depth == 8) {
+                    final_output = output_8bit;
                 }
+                cout << "Output Read Time: " << chrono::duration_cast<chrono::milliseconds>(t_mem_end - t_mem_start).count() << "ms" << endl;
+
+                // The fast path skipped the intermediate readbacks; fetch them once for the displays
+                if (fast_path) {
+                    equalizer.readBins(equalizer.d_hist, all_histograms, false);
+                    equalizer.readBins(equalizer.d_cum_hist, all_cum_histograms, false);
+                    equalizer.readBins(equalizer.d_lut, all_luts);
+                    all_hs_cum_histograms = all_cum_histograms;
+                }
+            }
+            t_device_end = chrono::high_resolution_clock::now();
+
+            // Device-side timings of the same run, separated from host overhead
+            if (profiling) {
+                queue.finish();
+                printProfilingReport(equalizer.profile, chrono::duration_cast<chrono::nanoseconds>(t_device_end - total_start).count());
             }
+        }
+
+        if (!save_histogram.empty() && saveHistogramFile(save_histogram, all_histograms, num_bins)) {
+            cout << "Histogram written to " << save_histogram << endl;
+        }
+
+        vector<vector<long long>> histograms(hist_channels), cum_histograms(hist_channels), hs_cum_histograms(hist_channels);
+        vector<vector<int>> luts(hist_channels);
+        vector<string> row_names(hist_channels);
+        for (int c = 0; c < hist_channels; c++) {
+            histograms[c].assign(all_histograms.begin() + c * num_bins, all_histograms.begin() + (c + 1) * num_bins);
+            cum_histograms[c].assign(all_cum_histograms.begin() + c * num_bins, all_cum_histograms.begin() + (c + 1) * num_bins);
+            hs_cum_histograms[c].assign(all_hs_cum_histograms.begin() + c * num_bins, all_hs_cum_histograms.begin() + (c + 1) * num_bins);
+            luts[c].assign(all_luts.begin() + c * num_bins, all_luts.begin() + (c + 1) * num_bins);
+            row_names[c] = luma ? "Luma" : "Channel " + to_string(c);
+
+            // Debug: Check LUT
+            cout << row_names[c] << " LUT Min: " << *min_element(luts[c].begin(), luts[c].end())
+                 << ", Max: " << *max_element(luts[c].begin(), luts[c].end()) << endl;
+        }
+        for (int c = 0; c < channels; c++) {
+            // Debug: Check output range and sample values across the image
+            const unsigned short* plane = final_output.data(0, 0, 0, c);
+            cout << "Channel " << c << " Output Min: " << *min_element(plane, plane + total_pixels)
+                 << ", Max: " << *max_element(plane, plane + total_pixels) << endl;
+            cout << "Sample Output Values (Top-Left, Top-Right, Mid, Bottom-Left, Bottom-Right): "
+                 << plane[0] << ", " << plane[width - 1] << ", " << plane[total_pixels / 2] << ", "
+                 << plane[(height - 1) * width] << ", " << plane[total_pixels - 1] << endl;
+            size_t non_zero_count = static_cast<size_t>(count_if(plane, plane + total_pixels, [](unsigned short v) { return v > 0; }));
             cout << "Channel " << c << " Non-Zero Pixels in final_output: " << non_zero_count << " / " << total_pixels << endl;
         }
 
@@ -413,11 +1275,11 @@ int main(int argc, char **argv) {
              << (int)display_output(width - 1, height - 1, 0, 0) << endl;
 
         vector<CImgDisplay> hist_displays;
-        for (int c = 0; c < channels; c++) {
-            string hist_title = "Histogram Channel " + to_string(c);
-            string cum_hist_title = "Blelloch Cumulative Histogram Channel " + to_string(c);
-            string hs_cum_hist_title = "Hillis-Steele Cumulative Histogram Channel " + to_string(c);
-            string lut_title = "LUT Channel " + to_string(c);
+        for (int c = 0; c < hist_channels; c++) {
+            string hist_title = "Histogram " + row_names[c];
+            string cum_hist_title = "Blelloch Cumulative Histogram " + row_names[c];
+            string hs_cum_hist_title = "Hillis-Steele Cumulative Histogram " + row_names[c];
+            string lut_title = "LUT " + row_names[c];
             hist_displays.push_back(CImgDisplay(createHistogramImage(histograms[c]), hist_title.c_str()));
             hist_displays.push_back(CImgDisplay(createHistogramImage(cum_histograms[c]), cum_hist_title.c_str()));
             hist_displays.push_back(CImgDisplay(createHistogramImage(hs_cum_histograms[c]), hs_cum_hist_title.c_str()));